@@ -5,24 +5,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define PAGE_SIZE 2048        // 2kb page size
 #define ADDRESS_SIZE 32       // 32 bit virtual address
 #define TABLE_ENTRIES 2097152 // 2^21 pages
 #define INT_MAX 2147483647
 
+#define BENCH_REPEATS 3       // Timed runs per kernel in benchmark mode
+#define RING_SLOTS 65536      // Records in the shared-memory trace ring (power of two)
+#define RING_MAGIC 0x564d5352 // "VMSR"
+#define SHARD_BATCH 1024      // Accesses the dispatcher hands to a worker at once
+#define SHARD_QUEUE_DEPTH 8   // Batches in flight per worker
+
 // Global variable
 int num_of_frames = 0; // This will be set from command line
-char *algorithm = NULL;
+char *algorithm = NULL; // One or more comma separated algorithms
 int refresh_rate = 0;
+long long stats_interval = 0; // Print running stats every this many trace records, 0 disables
+int profile_top_k = 0;        // Report this many hot and thrashing pages, 0 disables profiling
+int benchmark = 0;            // Time the generic loop against the specialised kernels instead of reporting stats
+int regret_windows = 0;       // Compare every eviction against opt's choice, reported over this many windows; 0 disables
+int shard_count = 0;          // Split the frames over this many hashed partitions, 0 disables
+int shard_threads = 0;        // Most worker threads tried by the sharded mode's scaling sweep
 
-// Stats
-static int page_faults = 0;
-static int writes = 0;
-static int total_accesses = 0;
-
-// Track of how many frames have been allocated so far
-static int frames_allocated = 0;
+// Set from the SIGINT handler so a live run can stop and still report
+static volatile sig_atomic_t stop_requested = 0;
 
 // Structs to hold the page table entry
 struct page_table_entry
@@ -30,6 +46,14 @@ struct page_table_entry
     int valid;
     int ref;
     int dirty;
+    int frame; // Index into the simulation's frame_table while the page is resident
+    unsigned int last_access; // Record index + 1 of the previous access, kept only when profiling (0 if never seen)
+    union // Tiered mode and profiling cannot be combined, so they share the word
+    {
+        unsigned int resident_hits; // Accesses since the page entered the slow tier (tiered promotion)
+        unsigned int accesses;      // Accesses so far, kept only when profiling
+    };
+    struct node *clock_node;    // The page's node in the clock list, for the clock algorithm
 };
 
 struct tuple
@@ -38,236 +62,114 @@ struct tuple
     __uint32_t add;
 };
 
-// OPT list
+// Next-use index
 // begin implementation
-// Define the two dimentional list
-struct access
+// For every valid trace record, how many records later the same page is accessed next.
+// It is built in one pass over the trace, saved next to it and memory-mapped by later
+// runs over the same trace, and gives opt and the regret analysis each page's next use
+// in constant time.
+#define NEXT_USE_NEVER 0xFFFFFFFFu // The page is not accessed again
+#define NEXT_USE_ESCAPE 0xFFFF     // The delta is too large for 16 bits, look it up among the far deltas
+#define NEXT_USE_MAGIC 0x554e4d56  // "VMNU"
+#define NEXT_USE_VERSION 2
+#define NEXT_USE_HASH_SAMPLES 256  // Blocks of the trace hashed to recognise it
+#define NEXT_USE_HASH_BLOCK 4096
+
+// A next use too far away for a 16 bit delta
+struct next_use_far
 {
-    int line_num;
-    struct access *next;
+    unsigned int record;
+    unsigned int next;
 };
 
-struct page_list_opt
+// What an index file was built from. Any change to the trace's size, modification time,
+// inode or sampled content makes its index stale.
+struct next_use_key
 {
-    int page_num;
-    struct page_list_opt *next;
-    struct access *head;
+    long long trace_size;
+    long long trace_mtime_sec;
+    long long trace_mtime_nsec;
+    unsigned long long trace_dev;
+    unsigned long long trace_ino;
+    unsigned long long trace_hash;
 };
 
-struct page_list_opt *create_page_list_node(int page_num)
-{
-    struct page_list_opt *node = (struct page_list_opt *)malloc(sizeof(struct page_list_opt));
-    if (!node)
-    {
-        perror("Failed to allocate memory for page list node");
-        exit(EXIT_FAILURE);
-    }
-    node->page_num = page_num;
-    node->next = NULL;
-    node->head = NULL;
-    return node;
-}
-
-void add_access(struct page_list_opt *page_node, int line_num)
+// Layout of the index file: the header, the deltas padded to 8 bytes, then the far deltas
+struct next_use_header
 {
-    struct access *new_access = (struct access *)malloc(sizeof(struct access));
-    if (!new_access)
-    {
-        perror("Failed to allocate memory for access");
-        exit(EXIT_FAILURE);
-    }
-    new_access->line_num = line_num;
-    new_access->next = page_node->head;
-    page_node->head = new_access;
-}
+    unsigned int magic;
+    unsigned int version;
+    struct next_use_key key;
+    long long records;
+    long long far_count;
+};
 
-struct page_list_opt *find_or_add_page(struct page_list_opt **root, int page_num)
+struct next_use_index
 {
-    struct page_list_opt *current = *root;
-    struct page_list_opt *last = NULL;
-
-    // Search for the page or the last node in the list
-    while (current != NULL && current->page_num != page_num)
-    {
-        last = current;
-        current = current->next;
-    }
-
-    // If the page was found
-    if (current != NULL)
-    {
-        return current;
-    }
+    unsigned short *deltas;     // Record index -> records until its page's next access, 0 if never
+    struct next_use_far *far;   // Escaped deltas, sorted by record
+    long long far_count;
+    long long records;
+    void *map;                  // The index file's mapping, NULL while the index lives on the heap
+    size_t map_size;
+};
 
-    // Page not found, create a new node
-    struct page_list_opt *new_node = create_page_list_node(page_num);
-    if (last == NULL)
-    { // This means the list was empty
-        *root = new_node;
-    }
-    else
-    {
-        last->next = new_node;
-    }
-    return new_node;
-}
+// Shared, read-only next-use index for opt and the regret analysis
+struct next_use_index next_use_index;
 
-// Function to find a page in the list
-struct page_list_opt *find_page(struct page_list_opt *root, int page_num)
+unsigned int next_use_far_lookup(long long record)
 {
-    struct page_list_opt *current = root;
-
-    // Search for the page
-    while (current != NULL)
+    long long low = 0, high = next_use_index.far_count - 1;
+    while (low <= high)
     {
-        if (current->page_num == page_num)
+        long long mid = (low + high) / 2;
+        if (next_use_index.far[mid].record < record)
         {
-            return current; // Page found
+            low = mid + 1;
         }
-        current = current->next;
-    }
-
-    return NULL; // Page not found
-}
-
-void free_all(struct page_list_opt *root)
-{
-    while (root != NULL)
-    {
-        struct page_list_opt *temp = root;
-        root = root->next;
-
-        struct access *acc = temp->head;
-        while (acc != NULL)
+        else if (next_use_index.far[mid].record > record)
         {
-            struct access *acc_temp = acc;
-            acc = acc->next;
-            free(acc_temp);
+            high = mid - 1;
         }
-
-        free(temp);
-    }
-}
-
-void print_opt_list(struct page_list_opt *root)
-{
-    struct page_list_opt *current = root;
-    // if list is empty, print empty and return
-    if (current == NULL)
-    {
-        printf("List is empty.\n");
-        return;
-    }
-
-    while (current != NULL)
-    {
-        printf("Page number: %d:", current->page_num);
-        struct access *acc = current->head;
-        while (acc != NULL)
+        else
         {
-            printf("[[Line number: %d]] -> ", acc->line_num);
-            acc = acc->next;
+            return next_use_index.far[mid].next;
         }
-        current = current->next;
-        printf("\n");
     }
+    return NEXT_USE_NEVER;
 }
 
-// Given a page number and current line number, return the line with closest distance to the current line number in the future
-int get_closest_use_of_page(int page_num, int curr_line_num, struct page_list_opt *root)
+// Record index of the next access to the page of `record`
+static inline unsigned int next_use_at(long long record)
 {
-    struct page_list_opt *target = find_page(root, page_num);
-    if (target == NULL)
+    unsigned int delta = next_use_index.deltas[record];
+    if (delta == 0)
     {
-        return -1; // Page not found, return an error code or handle it as appropriate
+        return NEXT_USE_NEVER;
     }
-
-    struct access *acc = target->head;
-    int closest = INT_MAX; // Use INT_MAX to signify no future access is found
-
-    // Loop over the accesses and find the closest one to curr_line_num
-    while (acc != NULL)
+    if (delta == NEXT_USE_ESCAPE)
     {
-        if (acc->line_num > curr_line_num && acc->line_num < closest)
-        {
-            closest = acc->line_num;
-        }
-        acc = acc->next;
+        return next_use_far_lookup(record);
     }
-
-    return closest == INT_MAX ? -1 : closest; // If no access is closer, return -1 or another indicator
+    return (unsigned int)record + delta;
 }
 
-// Function to get the page with the furthest first future use
-int get_page_with_furthest_next_use(struct page_list_opt *root, int line_num)
+// Stop if the simulation has read past the records the index covers, which happens when
+// the trace grows after its index was built
+static inline void check_next_use_coverage(long long records)
 {
-    struct page_list_opt *current = root;
-    int max = -1;      // Initialize to -1 to indicate no future use has been found yet
-    int max_page = -1; // This will store the page number with the furthest future use
-
-    while (current != NULL)
+    if (next_use_index.deltas != NULL && records > next_use_index.records)
     {
-        int closest_future_use = get_closest_use_of_page(current->page_num, line_num, root); /* Get the next future use of this page after line line_num */
-        if (closest_future_use == -1)
-        { /* if the page isn't used in the future, then it's the perfect candidate. Return it. */
-            return current->page_num;
-        }
-
-        // printf("Page number: %d, closest future use after line %d: %d\n", current->page_num, line_num, closest_future_use);
-        if (closest_future_use > max) /* If it's furthest than the midn */
-        {
-            max = closest_future_use;
-            max_page = current->page_num;
-        }
-        current = current->next;
+        fprintf(stderr, "The trace has more records than its next-use index (%lld), it changed after the index was built.\nTerminating\n",
+                next_use_index.records);
+        exit(EXIT_FAILURE);
     }
-
-    return max_page; // Return the page number with the furthest future use, or -1 if none is found
 }
-// remove a page from the list
-void remove_page(struct page_list_opt **root, int page_num)
-{
-    if (root == NULL || *root == NULL)
-    {
-        return; // List is empty or NULL pointer provided
-    }
-
-    struct page_list_opt *current = *root;
-    struct page_list_opt *previous = NULL;
-
-    // Find the page and keep track of the previous node
-    while (current != NULL && current->page_num != page_num)
-    {
-        previous = current;
-        current = current->next;
-    }
-
-    if (current == NULL)
-    {
-        return; // Page not found
-    }
-
-    // If the page is the first node in the list
-    if (previous == NULL)
-    {
-        *root = current->next; // Update root to be the next node
-    }
-    else
-    {
-        previous->next = current->next; // Bypass the current node
-    }
-
-    // Free the associated accesses
-    struct access *acc = current->head;
-    while (acc != NULL)
-    {
-        struct access *next = acc->next;
-        free(acc);
-        acc = next;
-    }
 
-    // Free the page node itself
-    free(current);
+// The end of the trace stands in for "never", so gaps between next uses stay finite
+static inline long long next_use_time(unsigned int next_use)
+{
+    return next_use == NEXT_USE_NEVER ? next_use_index.records : (long long)next_use;
 }
 // end implementation
 
@@ -383,402 +285,3046 @@ void display_list(struct page_list *list)
     //printf("\n");
 }
 
-// Declare a list for the clock algorithm
-struct page_list clock_list;
-struct page_list_opt *opt_list;
 
 // end implementation
 
-static struct page_table_entry page_table[TABLE_ENTRIES];
+// Page hotness profiling
+// begin implementation
+// Per-page counters: accesses are counted exactly in the page table entry the access
+// already touches, count-min sketches estimate faults and dirty evictions in bounded
+// memory, and top-K lists track the pages with the most accesses (hot) and the most
+// faults (thrashing).
+#define SKETCH_DEPTH 4
+#define SKETCH_LINE_BITS 12   // 4096 cache lines of 16 counters per sketch
+#define SKETCH_LINE_COUNTERS 16
+#define IRG_BUCKETS 32 // Inter-reference gaps are binned by power of two
+#define TOPK_OVERSAMPLE 16
+#define TOPK_SAMPLE 8 // Once the hot list is full, a page is offered to it on every 8th access
+
+// A blocked count-min sketch: one hash picks a cache line and each row owns a
+// quarter of it, so an update or lookup costs a single cache miss.
+struct cm_sketch
+{
+    unsigned int counts[1 << SKETCH_LINE_BITS][SKETCH_LINE_COUNTERS] __attribute__((aligned(64)));
+};
 
-int get_page_number(__uint32_t virt_address)
+static inline unsigned long long sketch_hash(int page_number)
 {
-    return virt_address >> 11;
+    return (unsigned long long)(page_number + 1) * 0x9E3779B97F4A7C15ULL;
 }
 
-int get_offset(__uint32_t virt_address)
+static inline unsigned int *sketch_line(struct cm_sketch *sketch, unsigned long long hash)
 {
-    return virt_address & 0x7FF;
+    return sketch->counts[hash >> (64 - SKETCH_LINE_BITS)];
 }
 
-struct tuple sanitize_trace_line(char *trace_line)
+// Counter of `row` within the line, taken from independent hash bits
+static inline int sketch_pos(int row, unsigned long long hash)
 {
-    struct tuple result;
-
-    // If the first byte is an I instruction or the second byte is an S, L, M instruction => the line is valid and can be sanitized
+    return row * (SKETCH_LINE_COUNTERS / SKETCH_DEPTH) + (int)((hash >> (8 * row + 8)) & (SKETCH_LINE_COUNTERS / SKETCH_DEPTH - 1));
+}
 
-    if (trace_line[0] == 'I')
-    {
-        result.instruction_type = trace_line[0];
-    }
-    else if (trace_line[1] == 'M' || trace_line[1] == 'S' || trace_line[1] == 'L' || trace_line[1] == 'I')
-    {
-        result.instruction_type = trace_line[1];
-    }
-    else
+// Count one occurrence and return the page's updated estimate
+static inline unsigned int sketch_add(struct cm_sketch *sketch, int page_number)
+{
+    unsigned long long hash = sketch_hash(page_number);
+    unsigned int *line = sketch_line(sketch, hash);
+    unsigned int min = ++line[sketch_pos(0, hash)];
+    for (int row = 1; row < SKETCH_DEPTH; row++)
     {
-        result.instruction_type = 'X'; // Invalid instruction
+        unsigned int count = ++line[sketch_pos(row, hash)];
+        if (count < min)
+        {
+            min = count;
+        }
     }
-
-    sscanf(trace_line + 2, "%*c %x", &result.add);
-    return result;
+    return min;
 }
 
-int nru(int line_num)
+// Never underestimates; overestimates only through hash collisions
+static inline unsigned int sketch_estimate(struct cm_sketch *sketch, int page_number)
 {
-    // if line_num % refresh_rate == 0, reset ref bit
-    if (line_num % refresh_rate == 0)
+    unsigned long long hash = sketch_hash(page_number);
+    unsigned int *line = sketch_line(sketch, hash);
+    unsigned int min = line[sketch_pos(0, hash)];
+    for (int row = 1; row < SKETCH_DEPTH; row++)
     {
-        for (int i = 0; i < num_of_frames; i++)
+        unsigned int count = line[sketch_pos(row, hash)];
+        if (count < min)
         {
-            page_table[i].ref = 0;
+            min = count;
         }
     }
+    return min;
+}
 
-    int first_class_0 = -1;
-    int first_class_1 = -1;
-    int first_class_2 = -1;
-    int first_class_3 = -1;
-    for (int i = 0; i < num_of_frames; i++)
-    {
-        struct page_table_entry *entry = &page_table[i];
+struct topk_entry
+{
+    int page_number;
+    int heap_pos;
+    unsigned int irg[IRG_BUCKETS];   // Inter-reference gaps sampled since the page entered the hot list
+};
 
-        if (entry->ref == 0 && entry->dirty == 0)
-        { // class 0
-            if (first_class_0 == -1)
-            {
-                first_class_0 = i;
-                return first_class_0;
-            }
-        }
-        else if (entry->ref == 0 && entry->dirty == 1)
-        { // class 1
-            if (first_class_1 == -1)
-            {
-                first_class_1 = i;
-                continue;
-            }
-        }
-        else if (entry->ref == 1 && entry->dirty == 0)
-        { // class 2
-            if (first_class_2 == -1)
-            {
-                first_class_2 = i;
-                continue;
-            }
-        }
-        else if (entry->ref == 1 && entry->dirty == 1)
-        { // class 3
-            if (first_class_3 == -1)
-            {
-                first_class_3 = i;
-                continue;
-            }
-        }
-    }
+// Counts live in the heap itself so sifting only touches contiguous memory
+struct topk_heap_node
+{
+    unsigned int count;
+    int index;      // Into entries
+};
 
-    if (first_class_0 >= 0)
-    {
-        return first_class_0;
-    }
-    else if (first_class_1 >= 0)
+struct topk_hash_slot
+{
+    int page_number; // -1 if empty
+    int index;
+};
+
+// Top-K candidates: a min-heap on the pages' counts over k entries, found by page through an open-addressed hash
+struct topk
+{
+    int k;          // Capacity; reports show only the first entries, where counts are most accurate
+    int size;
+    struct topk_entry *entries;
+    struct topk_heap_node *heap;   // Smallest count first
+    struct topk_hash_slot *hash;
+    int hash_bits;
+};
+
+void topk_init(struct topk *t, int k)
+{
+    // Keep the hash at most a quarter full so probe runs stay short
+    t->hash_bits = 1;
+    while ((1 << t->hash_bits) < 4 * k)
     {
-        return first_class_1;
+        t->hash_bits++;
     }
-    else if (first_class_2 >= 0)
+
+    t->k = k;
+    t->size = 0;
+    t->entries = (struct topk_entry *)calloc(k, sizeof(struct topk_entry));
+    t->heap = (struct topk_heap_node *)malloc(k * sizeof(struct topk_heap_node));
+    t->hash = (struct topk_hash_slot *)malloc((1 << t->hash_bits) * sizeof(struct topk_hash_slot));
+    if (!t->entries || !t->heap || !t->hash)
     {
-        return first_class_2;
+        perror("Failed to allocate memory for top-K list");
+        exit(EXIT_FAILURE);
     }
-    else if (first_class_3 >= 0)
+    for (int i = 0; i < (1 << t->hash_bits); i++)
     {
-        return first_class_3;
+        t->hash[i].page_number = -1;
     }
+}
 
-    return -1;
+void topk_free(struct topk *t)
+{
+    free(t->entries);
+    free(t->heap);
+    free(t->hash);
 }
 
-int opt(int line_num)
+static inline int topk_home_slot(struct topk *t, int page_number)
 {
-    int furthest_page = get_page_with_furthest_next_use(opt_list, line_num);
-    // printf("furthest page from line %d: %d\n", line_num, furthest_page);
-    if (furthest_page == -1)
-    {
-        perror("Failed to find a page with furthest next use");
-        return -1;
-    }
+    return (int)(((unsigned int)page_number * 0x9E3779B1u) >> (32 - t->hash_bits));
+}
 
-    return furthest_page;
+static inline int topk_next_slot(struct topk *t, int slot)
+{
+    return (slot + 1) & ((1 << t->hash_bits) - 1);
 }
 
-int clock()
+static inline int topk_find(struct topk *t, int page_number)
 {
-    struct node *current = clock_list.head;
-    while (current != NULL)
+    for (int slot = topk_home_slot(t, page_number); t->hash[slot].page_number != -1; slot = topk_next_slot(t, slot))
     {
-        if (current->ref == 0)
-        {
-            int page_to_be_evicted = current->page_number;
-
-            // Remove the page from the list
-            remove_node(&clock_list, current);
-
-            return page_to_be_evicted;
-        }
-        else
+        if (t->hash[slot].page_number == page_number)
         {
-            current->ref = 0;
-            current = current->next;
+            return t->hash[slot].index;
         }
     }
     return -1;
 }
 
-void init_opt_list(struct page_list_opt **opt_list, FILE *trace_file)
+void topk_hash_insert(struct topk *t, int page_number, int index)
 {
-    char line[128];
-    int line_num = 0;
-    printf("Initializing opt list...\n");
-    struct page_list_opt *page_node;
+    int slot = topk_home_slot(t, page_number);
+    while (t->hash[slot].page_number != -1)
+    {
+        slot = topk_next_slot(t, slot);
+    }
+    t->hash[slot].page_number = page_number;
+    t->hash[slot].index = index;
+}
 
-    // Read each line from the trace file
-    while (fgets(line, sizeof(line), trace_file) != NULL)
+// Linear probing removal: shift later members of the probe run back into the hole
+void topk_hash_remove(struct topk *t, int page_number)
+{
+    int mask = (1 << t->hash_bits) - 1;
+    int slot = topk_home_slot(t, page_number);
+    while (t->hash[slot].page_number != page_number)
     {
-        struct tuple mem_access = sanitize_trace_line(line);
-        int page_number = get_page_number(mem_access.add);
+        slot = topk_next_slot(t, slot);
+    }
 
-        // if the mem access is invalid, skip it
-        if (page_number < 0 || page_number >= TABLE_ENTRIES || mem_access.instruction_type == 'X')
+    int hole = slot;
+    for (slot = topk_next_slot(t, hole); t->hash[slot].page_number != -1; slot = topk_next_slot(t, slot))
+    {
+        int home = topk_home_slot(t, t->hash[slot].page_number);
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
         {
-            if (page_number < 0)
-            {
-                perror("skipping line: negative page number.\n");
-            }
-
-            if (page_number >= TABLE_ENTRIES)
-            {
-                perror("skipping line: page number out of bounds.\n");
-            }
-
-            if (mem_access.instruction_type == 'X')
-            {
-                perror("skipping line: invalid instruction type.\n");
-            }
-            continue;
+            t->hash[hole] = t->hash[slot];
+            hole = slot;
         }
-
-        // Find or create a new page list node for the current page number
-        page_node = find_or_add_page(opt_list, page_number);
-        add_access(page_node, line_num);
-
-        line_num++; // Increment line number for the next read
     }
-    // Reset the file pointer to the beginning of the file for future use
-    rewind(trace_file);
-
-    printf("Opt list initialized succesfully.\n");
+    t->hash[hole].page_number = -1;
 }
 
-void allocate_page(char instruction_type, int page_number)
+static inline void topk_swap(struct topk *t, int a, int b)
 {
-    struct page_table_entry *entry = &page_table[page_number];
-    entry->valid = 1;
-    entry->ref = 1;
-    entry->dirty = instruction_type == 'S' || instruction_type == 'M' ? 1 : 0;
+    struct topk_heap_node tmp = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->entries[t->heap[a].index].heap_pos = a;
+    t->entries[t->heap[b].index].heap_pos = b;
 }
 
-void process_trace_file(FILE *f)
+void topk_sift_up(struct topk *t, int pos)
 {
-    if (f == NULL)
+    while (pos > 0 && t->heap[(pos - 1) / 2].count > t->heap[pos].count)
     {
-        perror("Unable to open file!");
-        return;
+        topk_swap(t, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
     }
+}
 
-    char line[128];
-    int line_num = 0;
-    while (fgets(line, sizeof(line), f) != NULL)
+static inline void topk_sift_down(struct topk *t, int pos)
+{
+    for (;;)
     {
-        // Sanitize the trace line by line
-        struct tuple mem_access = sanitize_trace_line(line);
-
-        // Get the intruction type and address
-        char instruction_type = mem_access.instruction_type;
-        __uint32_t address = mem_access.add;
-
-        // Compute page number and offset
-        int page_number = get_page_number(address);
-        int offset = get_offset(address);
-
-        // Check that page number is in bounds, and that the instruction type is valid
-        if (page_number < 0 || page_number >= TABLE_ENTRIES || instruction_type == 'X')
+        int smallest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < t->size && t->heap[left].count < t->heap[smallest].count)
         {
-            if (page_number < 0)
-            {
-                perror("skipping line: negative page number.\n");
-            }
-
-            if (page_number >= TABLE_ENTRIES)
-            {
-                perror("skipping line: page number out of bounds.\n");
-            }
-
-            if (instruction_type == 'X')
-            {
-                perror("skipping line: invalid instruction type.\n");
-            }
-            continue;
+            smallest = left;
         }
-        else if (instruction_type == 'M') /* Modify counts as two mem accesses */
+        if (right < t->size && t->heap[right].count < t->heap[smallest].count)
         {
-
-            total_accesses += 2;
+            smallest = right;
         }
-        else
+        if (smallest == pos)
         {
-            total_accesses++;
+            return;
         }
+        topk_swap(t, pos, smallest);
+        pos = smallest;
+    }
+}
 
-        // Find page table entry
-        struct page_table_entry *entry = &page_table[page_number];
+// Whether a page with this count would be kept on the list. Checked before offering,
+// so the long tail of cold pages costs a single comparison.
+static inline int topk_admits(struct topk *t, unsigned int count)
+{
+    return t->size < t->k || count > t->heap[0].count;
+}
 
-        // Get the current state of the page
-        int is_valid = entry->valid;
-        int is_referenced = entry->ref;
-        int is_dirty = entry->dirty;
+// Record a page's current count, taking over the smallest entry when the list is full.
+// Counts only grow, so an entry only ever moves down the heap. Returns NULL for
+// pages not on the list.
+static inline struct topk_entry *topk_offer(struct topk *t, int page_number, unsigned int count)
+{
+    int index = topk_find(t, page_number);
+    if (index >= 0)
+    {
+        struct topk_entry *entry = &t->entries[index];
+        t->heap[entry->heap_pos].count = count;
+        topk_sift_down(t, entry->heap_pos);
+        return entry;
+    }
 
-        // if the page is invalid, allocate a frame
-        if (!is_valid)
-        {
-            page_faults++;                        /* Accessing an invalid page causes a page fault */
-            if (frames_allocated < num_of_frames) /* If there is a free frame, allocate the page in that frame */
+    struct topk_entry *entry;
+    if (t->size < t->k)
+    {
+        index = t->size;
+        entry = &t->entries[index];
+        memset(entry, 0, sizeof(struct topk_entry));
+        entry->page_number = page_number;
+        entry->heap_pos = t->size;
+        t->heap[t->size].count = count;
+        t->heap[t->size].index = index;
+        t->size++;
+        topk_hash_insert(t, page_number, index);
+        topk_sift_up(t, entry->heap_pos);
+        return entry;
+    }
+
+    if (count <= t->heap[0].count)
+    {
+        return NULL;
+    }
+    index = t->heap[0].index;
+    entry = &t->entries[index];
+    topk_hash_remove(t, entry->page_number);
+    entry->page_number = page_number;
+    t->heap[0].count = count;
+    memset(entry->irg, 0, sizeof(entry->irg));
+    topk_hash_insert(t, page_number, index);
+    topk_sift_down(t, 0);
+    return entry;
+}
+
+struct page_profile
+{
+    struct cm_sketch faults;
+    struct cm_sketch dirty_evictions;
+    struct topk hot;                  // Most accessed pages
+    struct topk thrashing;            // Most faulting pages
+    unsigned long long irg[IRG_BUCKETS]; // Inter-reference gaps over all pages
+    unsigned long long cold_accesses;    // First accesses, which have no gap
+    int report_k;                        // Pages listed per report
+};
+
+struct page_profile *create_profile(int k)
+{
+    struct page_profile *profile = (struct page_profile *)calloc(1, sizeof(struct page_profile));
+    if (!profile)
+    {
+        perror("Failed to allocate memory for page profile");
+        exit(EXIT_FAILURE);
+    }
+    // Track several times more candidates than reported so the reported counts are tight
+    profile->report_k = k;
+    topk_init(&profile->hot, k * TOPK_OVERSAMPLE);
+    topk_init(&profile->thrashing, k * TOPK_OVERSAMPLE);
+    return profile;
+}
+
+void free_profile(struct page_profile *profile)
+{
+    if (profile == NULL)
+    {
+        return;
+    }
+    topk_free(&profile->hot);
+    topk_free(&profile->thrashing);
+    free(profile);
+}
+
+// Power-of-two bucket of a gap. A gap of 0 (a page evicted just before the record that
+// accesses it) goes in the first bucket with gaps of 1; or-ing in 1 keeps clz defined
+// without a branch on this per-access path.
+static inline int irg_bucket(long long gap)
+{
+    int bucket = 63 - __builtin_clzll((unsigned long long)gap | 1);
+    return bucket < IRG_BUCKETS ? bucket : IRG_BUCKETS - 1;
+}
+
+// The access count and previous access time live in the page table entry, which the access
+// has just touched anyway, so only the hot list upkeep can miss the cache
+static inline void profile_access(struct page_profile *profile, struct page_table_entry *page, int page_number, long long line_num)
+{
+    unsigned int accesses = ++page->accesses;
+
+    unsigned int now = (unsigned int)(line_num + 1);
+    unsigned int last = page->last_access;
+    page->last_access = now;
+    int bucket = -1;
+    if (last == 0)
+    {
+        profile->cold_accesses++;
+    }
+    else
+    {
+        bucket = irg_bucket(now - last); // Wraps cleanly for gaps below 2^32 records
+        profile->irg[bucket]++;
+    }
+
+    // Heap upkeep dominates the cost, so once the hot list is full it only sees a sample
+    // of each page's accesses. Counts are reported from the page table, so they stay exact;
+    // the per-page gap histograms hold a sample of the gaps.
+    struct topk *hot = &profile->hot;
+    if (hot->size < hot->k || ((accesses & (TOPK_SAMPLE - 1)) == 0 && accesses > hot->heap[0].count))
+    {
+        struct topk_entry *entry = topk_offer(hot, page_number, accesses);
+        if (entry != NULL && bucket >= 0)
+        {
+            entry->irg[bucket]++;
+        }
+    }
+}
+
+static inline void profile_fault(struct page_profile *profile, int page_number)
+{
+    unsigned int estimate = sketch_add(&profile->faults, page_number);
+    if (topk_admits(&profile->thrashing, estimate))
+    {
+        topk_offer(&profile->thrashing, page_number, estimate);
+    }
+}
+
+static inline void profile_dirty_eviction(struct page_profile *profile, int page_number)
+{
+    sketch_add(&profile->dirty_evictions, page_number);
+}
+
+struct topk_report_row
+{
+    struct topk_entry *entry;
+    unsigned int accesses;
+    unsigned int faults;
+};
+
+// Highest count first: accesses for the hot list, faults for the thrashing list
+int compare_by_accesses(const void *a, const void *b)
+{
+    const struct topk_report_row *x = (const struct topk_report_row *)a;
+    const struct topk_report_row *y = (const struct topk_report_row *)b;
+    return x->accesses < y->accesses ? 1 : x->accesses > y->accesses ? -1 : x->entry->page_number - y->entry->page_number;
+}
+
+int compare_by_faults(const void *a, const void *b)
+{
+    const struct topk_report_row *x = (const struct topk_report_row *)a;
+    const struct topk_report_row *y = (const struct topk_report_row *)b;
+    return x->faults < y->faults ? 1 : x->faults > y->faults ? -1 : x->entry->page_number - y->entry->page_number;
+}
+
+// Upper bound of the bucket holding the median gap, 0 without any gaps
+long long irg_median(unsigned int *irg)
+{
+    unsigned long long total = 0;
+    for (int i = 0; i < IRG_BUCKETS; i++)
+    {
+        total += irg[i];
+    }
+
+    unsigned long long seen = 0;
+    for (int i = 0; i < IRG_BUCKETS && total > 0; i++)
+    {
+        seen += irg[i];
+        if (2 * seen >= total)
+        {
+            return (2LL << i) - 1;
+        }
+    }
+    return 0;
+}
+
+// Report rows for a top-K list, sorted with `compare`. The heap holds counts as of each
+// page's last offer, so the rows take the final counts: accesses from the page table and
+// faults from the sketch. Either source may be NULL.
+struct topk_report_row *rank_topk(struct topk *t, struct page_table_entry *page_table, struct cm_sketch *faults,
+                                  int (*compare)(const void *, const void *))
+{
+    struct topk_report_row *rows = (struct topk_report_row *)malloc((t->size + 1) * sizeof(struct topk_report_row));
+    if (!rows)
+    {
+        perror("Failed to allocate memory for top-K report");
+        return NULL;
+    }
+
+    for (int i = 0; i < t->size; i++)
+    {
+        struct topk_entry *entry = &t->entries[i];
+        rows[i].entry = entry;
+        rows[i].accesses = page_table != NULL ? page_table[entry->page_number].accesses : 0;
+        rows[i].faults = faults != NULL ? sketch_estimate(faults, entry->page_number) : 0;
+    }
+    qsort(rows, t->size, sizeof(struct topk_report_row), compare);
+    return rows;
+}
+
+void print_topk(struct page_profile *profile, struct page_table_entry *page_table, struct topk *t, const char *title)
+{
+    struct topk_report_row *rows = rank_topk(t, page_table, &profile->faults,
+                                             t == &profile->hot ? compare_by_accesses : compare_by_faults);
+    if (!rows)
+    {
+        return;
+    }
+
+    printf("\n%s\n", title);
+    printf("%-4s %8s %-17s %10s %10s %8s %10s\n",
+           "Rank", "Page", "Address range", "Accesses", "Faults", "DirtyEv", "MedianIRG");
+    for (int i = 0; i < t->size && i < profile->report_k; i++)
+    {
+        struct topk_entry *entry = rows[i].entry;
+        __uint32_t start = (__uint32_t)entry->page_number << 11;
+
+        // Gap histograms are kept by the hot list only
+        int hot_index = topk_find(&profile->hot, entry->page_number);
+        long long median = hot_index >= 0 ? irg_median(profile->hot.entries[hot_index].irg) : 0;
+        char median_text[24];
+        if (median > 0)
+        {
+            snprintf(median_text, sizeof(median_text), "<=%lld", median);
+        }
+        else
+        {
+            snprintf(median_text, sizeof(median_text), "-");
+        }
+
+        printf("%-4d %8x %08x-%08x %10u %10u %8u %10s\n",
+               i + 1, entry->page_number, start, start + PAGE_SIZE - 1,
+               rows[i].accesses, rows[i].faults,
+               sketch_estimate(&profile->dirty_evictions, entry->page_number), median_text);
+    }
+    free(rows);
+}
+
+void print_profile(struct page_profile *profile, struct page_table_entry *page_table, char *algorithm)
+{
+    char title[96];
+    snprintf(title, sizeof(title), "Hot pages (%s):##############################################", algorithm);
+    print_topk(profile, page_table, &profile->hot, title);
+    snprintf(title, sizeof(title), "Thrashing pages (%s):########################################", algorithm);
+    print_topk(profile, page_table, &profile->thrashing, title);
+
+    printf("\nInter-reference gaps (records):\n");
+    printf("  first access: %llu\n", profile->cold_accesses);
+    for (int i = 0; i < IRG_BUCKETS; i++)
+    {
+        if (profile->irg[i] > 0)
+        {
+            printf("  %lld-%lld: %llu\n", 1LL << i, (2LL << i) - 1, profile->irg[i]);
+        }
+    }
+}
+// end implementation
+
+// Simulation state
+// begin implementation
+enum policy
+{
+    POLICY_OPT,
+    POLICY_NRU,
+    POLICY_CLOCK
+};
+
+struct budget_event
+{
+    int access;     // Apply once total_accesses reaches this value
+    int frames;     // New frame budget
+    int order;      // Position in the schedule as given, entries for the same access apply in this order
+};
+
+// A phase is a stretch of the trace run under a single frame budget
+struct phase_stats
+{
+    char source;              // 'i' initial budget, 's' schedule, 'p' page-fault-frequency control
+    long long start_access;   // total_accesses when the phase began
+    int frames;               // Frame budget during the phase
+    int prev_frames;          // Frame budget of the previous phase
+    long long start_faults;   // page_faults when the phase began
+    long long start_writes;   // writes when the phase began (before any bulk eviction)
+    long long end_access;     // Filled in when the phase ends
+    long long end_faults;
+    long long end_writes;
+    int bulk_evictions;       // Pages evicted at once to fit a smaller budget
+    int bulk_writes;          // Dirty pages among them
+    double baseline_rate;     // Fault rate of the last full window before the phase began
+    long long recovered_after; // Accesses into a shrink phase until a window's fault rate fell back to baseline_rate, -1 if never
+};
+
+// One independent simulation: its own page table, frames, algorithm state and stats.
+// Several of them can consume the same trace side by side.
+struct vm_sim
+{
+    char *algorithm;
+    enum policy policy;
+    int num_of_frames;
+
+    struct page_table_entry *page_table; // TABLE_ENTRIES entries
+    int *frame_table;                    // Frame number -> resident page number (frames 0..frames_allocated-1 are in use)
+    int frame_capacity;
+    int frames_allocated;                // Track of how many frames have been allocated so far
+    struct page_list clock_list;         // List for the clock algorithm
+    struct page_profile *profile;        // Per-page hotness profile, NULL unless enabled
+    unsigned int *next_use;              // Page number -> record index of its next access, for opt and regret only
+    struct policy_regret *regret;        // Eviction decisions compared against opt, NULL unless enabled
+
+    // Stats
+    long long page_faults;
+    long long writes;
+    long long total_accesses;
+
+    // Running stats printed every stats_interval records
+    long long interval_start_accesses;
+    long long interval_start_faults;
+
+    // Frame budget phases
+    int next_event;
+    struct phase_stats *phases;
+    int phase_count;
+    int phase_capacity;
+    long long window_start_access;
+    long long window_start_faults;
+    double last_window_rate;
+};
+
+int parse_policy(char *name, enum policy *policy)
+{
+    if (strcmp(name, "opt") == 0)
+    {
+        *policy = POLICY_OPT;
+    }
+    else if (strcmp(name, "nru") == 0)
+    {
+        *policy = POLICY_NRU;
+    }
+    else if (strcmp(name, "clock") == 0)
+    {
+        *policy = POLICY_CLOCK;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void reserve_frames(struct vm_sim *sim, int frames);
+void free_regret(struct policy_regret *regret);
+
+void init_sim(struct vm_sim *sim, char *name, enum policy policy)
+{
+    memset(sim, 0, sizeof(struct vm_sim));
+    sim->algorithm = name;
+    sim->policy = policy;
+    sim->num_of_frames = num_of_frames;
+    sim->clock_list.head = NULL;
+    sim->last_window_rate = -1.0;
+
+    sim->page_table = (struct page_table_entry *)calloc(TABLE_ENTRIES, sizeof(struct page_table_entry));
+    if (!sim->page_table)
+    {
+        perror("Failed to allocate memory for page table");
+        exit(EXIT_FAILURE);
+    }
+    reserve_frames(sim, sim->num_of_frames);
+
+    if (profile_top_k > 0)
+    {
+        sim->profile = create_profile(profile_top_k);
+    }
+
+    // Pages' next uses are only needed to pick opt's victims
+    if (policy == POLICY_OPT || regret_windows > 0)
+    {
+        sim->next_use = (unsigned int *)malloc(TABLE_ENTRIES * sizeof(unsigned int));
+        if (!sim->next_use)
+        {
+            perror("Failed to allocate memory for next uses");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void free_sim(struct vm_sim *sim)
+{
+    while (sim->clock_list.head != NULL)
+    {
+        remove_node(&sim->clock_list, sim->clock_list.head);
+    }
+    free(sim->page_table);
+    free(sim->frame_table);
+    free(sim->phases);
+    free_profile(sim->profile);
+    free(sim->next_use);
+    free_regret(sim->regret);
+}
+// end implementation
+
+int get_page_number(__uint32_t virt_address)
+{
+    return virt_address >> 11;
+}
+
+int get_offset(__uint32_t virt_address)
+{
+    return virt_address & 0x7FF;
+}
+
+struct tuple sanitize_trace_line(char *trace_line)
+{
+    struct tuple result;
+
+    // If the first byte is an I instruction or the second byte is an S, L, M instruction => the line is valid and can be sanitized
+
+    if (trace_line[0] == 'I')
+    {
+        result.instruction_type = trace_line[0];
+    }
+    else if (trace_line[1] == 'M' || trace_line[1] == 'S' || trace_line[1] == 'L' || trace_line[1] == 'I')
+    {
+        result.instruction_type = trace_line[1];
+    }
+    else
+    {
+        result.instruction_type = 'X'; // Invalid instruction
+    }
+
+    sscanf(trace_line + 2, "%*c %x", &result.add);
+    return result;
+}
+
+// Reset the reference bit of every resident page (NRU periodic refresh)
+void nru_refresh(struct vm_sim *sim)
+{
+    for (int i = 0; i < sim->frames_allocated; i++)
+    {
+        sim->page_table[sim->frame_table[i]].ref = 0;
+    }
+}
+
+int nru(struct vm_sim *sim)
+{
+    int first_class_0 = -1;
+    int first_class_1 = -1;
+    int first_class_2 = -1;
+    int first_class_3 = -1;
+    for (int i = 0; i < sim->frames_allocated; i++)
+    {
+        int page_number = sim->frame_table[i];
+        struct page_table_entry *entry = &sim->page_table[page_number];
+
+        if (entry->ref == 0 && entry->dirty == 0)
+        { // class 0
+            if (first_class_0 == -1)
+            {
+                first_class_0 = page_number;
+                return first_class_0;
+            }
+        }
+        else if (entry->ref == 0 && entry->dirty == 1)
+        { // class 1
+            if (first_class_1 == -1)
+            {
+                first_class_1 = page_number;
+                continue;
+            }
+        }
+        else if (entry->ref == 1 && entry->dirty == 0)
+        { // class 2
+            if (first_class_2 == -1)
+            {
+                first_class_2 = page_number;
+                continue;
+            }
+        }
+        else if (entry->ref == 1 && entry->dirty == 1)
+        { // class 3
+            if (first_class_3 == -1)
+            {
+                first_class_3 = page_number;
+                continue;
+            }
+        }
+    }
+
+    if (first_class_0 >= 0)
+    {
+        return first_class_0;
+    }
+    else if (first_class_1 >= 0)
+    {
+        return first_class_1;
+    }
+    else if (first_class_2 >= 0)
+    {
+        return first_class_2;
+    }
+    else if (first_class_3 >= 0)
+    {
+        return first_class_3;
+    }
+
+    return -1;
+}
+
+// Evict the resident page whose next use is furthest away, or the first one never used again
+int opt(struct vm_sim *sim)
+{
+    int furthest_page = -1;
+    unsigned int furthest = 0;
+    for (int i = 0; i < sim->frames_allocated; i++)
+    {
+        int page_num = sim->frame_table[i];
+        unsigned int next_use = sim->next_use[page_num];
+        if (next_use == NEXT_USE_NEVER)
+        {
+            return page_num;
+        }
+        if (furthest_page == -1 || next_use > furthest)
+        {
+            furthest = next_use;
+            furthest_page = page_num;
+        }
+    }
+
+    if (furthest_page == -1)
+    {
+        perror("Failed to find a page with furthest next use");
+    }
+    return furthest_page;
+}
+
+int clock_algorithm(struct vm_sim *sim)
+{
+    struct node *current = sim->clock_list.head;
+    while (current != NULL)
+    {
+        // The page table holds the live reference bit, hits only update it there
+        struct page_table_entry *entry = &sim->page_table[current->page_number];
+        if (entry->ref == 0)
+        {
+            // Leave the hand on the victim; releasing its frame removes the node and moves the hand on
+            sim->clock_list.head = current;
+            return current->page_number;
+        }
+        else
+        {
+            entry->ref = 0;
+            current = current->next;
+        }
+    }
+    return -1;
+}
+
+int compare_far_deltas(const void *a, const void *b)
+{
+    const struct next_use_far *x = (const struct next_use_far *)a;
+    const struct next_use_far *y = (const struct next_use_far *)b;
+    return x->record < y->record ? -1 : x->record > y->record ? 1 : 0;
+}
+
+// Build the next-use index in one pass: every record fills in the delta of the previous
+// record to the same page
+void build_next_use_index(struct next_use_index *index, FILE *trace_file)
+{
+    char line[128];
+    long long capacity = 1 << 16;
+    long long far_capacity = 1 << 10;
+    fprintf(stderr, "Building next-use index...\n");
+
+    // Record index + 1 of each page's latest record, 0 if not seen yet
+    unsigned int *last_seen = (unsigned int *)calloc(TABLE_ENTRIES, sizeof(unsigned int));
+    memset(index, 0, sizeof(struct next_use_index));
+    index->deltas = (unsigned short *)malloc(capacity * sizeof(unsigned short));
+    index->far = (struct next_use_far *)malloc(far_capacity * sizeof(struct next_use_far));
+    if (!last_seen || !index->deltas || !index->far)
+    {
+        perror("Failed to allocate memory for next-use index");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read each line from the trace file
+    while (fgets(line, sizeof(line), trace_file) != NULL)
+    {
+        struct tuple mem_access = sanitize_trace_line(line);
+        int page_number = get_page_number(mem_access.add);
+
+        // if the mem access is invalid, skip it
+        if (page_number < 0 || page_number >= TABLE_ENTRIES || mem_access.instruction_type == 'X')
+        {
+            if (page_number < 0)
+            {
+                perror("skipping line: negative page number.\n");
+            }
+
+            if (page_number >= TABLE_ENTRIES)
+            {
+                perror("skipping line: page number out of bounds.\n");
+            }
+
+            if (mem_access.instruction_type == 'X')
+            {
+                perror("skipping line: invalid instruction type.\n");
+            }
+            continue;
+        }
+
+        if (index->records == NEXT_USE_NEVER - 1)
+        {
+            fprintf(stderr, "Trace too long for the next-use index: more than %u records.\n", NEXT_USE_NEVER - 1);
+            exit(EXIT_FAILURE);
+        }
+        if (index->records == capacity)
+        {
+            capacity *= 2;
+            index->deltas = (unsigned short *)realloc(index->deltas, capacity * sizeof(unsigned short));
+            if (!index->deltas)
+            {
+                perror("Failed to allocate memory for next-use index");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        unsigned int record = (unsigned int)index->records;
+        index->deltas[record] = 0;
+        if (last_seen[page_number] != 0)
+        {
+            unsigned int previous = last_seen[page_number] - 1;
+            unsigned int delta = record - previous;
+            if (delta < NEXT_USE_ESCAPE)
+            {
+                index->deltas[previous] = (unsigned short)delta;
+            }
+            else
+            {
+                if (index->far_count == far_capacity)
+                {
+                    far_capacity *= 2;
+                    index->far = (struct next_use_far *)realloc(index->far, far_capacity * sizeof(struct next_use_far));
+                    if (!index->far)
+                    {
+                        perror("Failed to allocate memory for next-use index");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                index->deltas[previous] = NEXT_USE_ESCAPE;
+                index->far[index->far_count].record = previous;
+                index->far[index->far_count].next = record;
+                index->far_count++;
+            }
+        }
+        last_seen[page_number] = record + 1;
+        index->records++;
+    }
+    free(last_seen);
+
+    // Far deltas are found in the order of their later record, lookups need them by the earlier one
+    qsort(index->far, index->far_count, sizeof(struct next_use_far), compare_far_deltas);
+
+    // Reset the file pointer to the beginning of the file for future use
+    rewind(trace_file);
+
+    fprintf(stderr, "Next-use index built: %lld records.\n", index->records);
+}
+
+// Hash the trace's size and evenly spaced blocks of its content. Reading a few blocks
+// keeps recognising a large trace cheap; the modification time in the key catches a
+// trace rewritten in place with the same sampled blocks.
+unsigned long long hash_trace(int fd, long long size)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL ^ (unsigned long long)size;
+    unsigned char block[NEXT_USE_HASH_BLOCK];
+    long long stride = size / NEXT_USE_HASH_SAMPLES;
+    if (stride < NEXT_USE_HASH_BLOCK)
+    {
+        stride = NEXT_USE_HASH_BLOCK; // Small traces are hashed whole
+    }
+
+    for (long long offset = 0; offset < size; offset += stride)
+    {
+        ssize_t length = pread(fd, block, sizeof(block), offset);
+        for (ssize_t i = 0; i < length; i++)
+        {
+            hash = (hash ^ block[i]) * 0x100000001b3ULL;
+        }
+    }
+
+    // Always include the tail, where a trace that was still being written differs
+    if (size > NEXT_USE_HASH_BLOCK)
+    {
+        ssize_t length = pread(fd, block, sizeof(block), size - NEXT_USE_HASH_BLOCK);
+        for (ssize_t i = 0; i < length; i++)
+        {
+            hash = (hash ^ block[i]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static inline size_t next_use_deltas_size(long long records)
+{
+    return ((size_t)records * sizeof(unsigned short) + 7) & ~(size_t)7;
+}
+
+// Map an index file saved for this trace, returning 0 if there is none or it is stale
+int map_next_use_index(struct next_use_index *index, char *path, struct next_use_key *key)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct stat st;
+    struct next_use_header header;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        header.magic != NEXT_USE_MAGIC || header.version != NEXT_USE_VERSION ||
+        memcmp(&header.key, key, sizeof(struct next_use_key)) != 0 ||
+        (size_t)st.st_size != sizeof(header) + next_use_deltas_size(header.records) + header.far_count * sizeof(struct next_use_far))
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    memset(index, 0, sizeof(struct next_use_index));
+    index->map = map;
+    index->map_size = st.st_size;
+    index->records = header.records;
+    index->far_count = header.far_count;
+    index->deltas = (unsigned short *)((char *)map + sizeof(header));
+    index->far = (struct next_use_far *)((char *)map + sizeof(header) + next_use_deltas_size(header.records));
+    return 1;
+}
+
+// Save the index next to the trace. Written to a temporary file and renamed into place,
+// so a concurrent run never maps a partial index.
+void save_next_use_index(struct next_use_index *index, char *path, struct next_use_key *key)
+{
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not save the next-use index to %s, it will be rebuilt next time.\n", path);
+        return;
+    }
+
+    struct next_use_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = NEXT_USE_MAGIC;
+    header.version = NEXT_USE_VERSION;
+    header.key = *key;
+    header.records = index->records;
+    header.far_count = index->far_count;
+
+    static const char padding[8] = {0};
+    size_t padding_size = next_use_deltas_size(index->records) - index->records * sizeof(unsigned short);
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(index->deltas, sizeof(unsigned short), index->records, file) == (size_t)index->records &&
+             fwrite(padding, 1, padding_size, file) == padding_size &&
+             fwrite(index->far, sizeof(struct next_use_far), index->far_count, file) == (size_t)index->far_count;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(temp_path, path) != 0)
+    {
+        fprintf(stderr, "Could not save the next-use index to %s, it will be rebuilt next time.\n", path);
+        unlink(temp_path);
+    }
+}
+
+// Map the index saved by an earlier run over the same trace, or build and save it.
+// `trace_path` is NULL for a trace read from standard input, which has no path to keep
+// an index next to, so its index is always built and never saved.
+void load_next_use_index(struct next_use_index *index, char *trace_path, FILE *trace_file)
+{
+    if (trace_path == NULL)
+    {
+        build_next_use_index(index, trace_file);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fileno(trace_file), &st) != 0)
+    {
+        perror("Failed to read the trace file size");
+        exit(EXIT_FAILURE);
+    }
+    struct next_use_key key;
+    memset(&key, 0, sizeof(key));
+    key.trace_size = st.st_size;
+    key.trace_mtime_sec = st.st_mtim.tv_sec;
+    key.trace_mtime_nsec = st.st_mtim.tv_nsec;
+    key.trace_dev = st.st_dev;
+    key.trace_ino = st.st_ino;
+    key.trace_hash = hash_trace(fileno(trace_file), st.st_size);
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.nextuse", trace_path);
+    if (map_next_use_index(index, index_path, &key))
+    {
+        fprintf(stderr, "Next-use index loaded from %s: %lld records.\n", index_path, index->records);
+        return;
+    }
+
+    build_next_use_index(index, trace_file);
+    save_next_use_index(index, index_path, &key);
+}
+
+void free_next_use_index(struct next_use_index *index)
+{
+    if (index->map != NULL)
+    {
+        munmap(index->map, index->map_size);
+    }
+    else
+    {
+        free(index->deltas);
+        free(index->far);
+    }
+    memset(index, 0, sizeof(struct next_use_index));
+}
+
+// Make sure the frame table can hold at least `frames` resident pages
+void reserve_frames(struct vm_sim *sim, int frames)
+{
+    if (frames <= sim->frame_capacity)
+    {
+        return;
+    }
+
+    int *grown = (int *)realloc(sim->frame_table, frames * sizeof(int));
+    if (!grown)
+    {
+        perror("Failed to allocate memory for frame table");
+        exit(EXIT_FAILURE);
+    }
+    sim->frame_table = grown;
+    sim->frame_capacity = frames;
+}
+
+// `policy` is a compile-time constant inside the specialised kernels, so the algorithm checks fold away there
+static inline __attribute__((always_inline)) void allocate_page_kernel(struct vm_sim *sim, char instruction_type, int page_number, enum policy policy)
+{
+    struct page_table_entry *entry = &sim->page_table[page_number];
+    entry->valid = 1;
+    entry->ref = 1;
+    entry->dirty = instruction_type == 'S' || instruction_type == 'M' ? 1 : 0;
+
+    // Take the next free frame
+    entry->frame = sim->frames_allocated;
+    sim->frame_table[sim->frames_allocated] = page_number;
+    sim->frames_allocated++;
+
+    // Add page to the clock list if the algorithm is clock
+    if (policy == POLICY_CLOCK)
+    {
+        struct node *new_node = create_node(1, page_number);
+        insert_node(&sim->clock_list, new_node);
+        entry->clock_node = new_node;
+    }
+}
+
+void allocate_page(struct vm_sim *sim, char instruction_type, int page_number)
+{
+    allocate_page_kernel(sim, instruction_type, page_number, sim->policy);
+}
+
+// Ask the algorithm for a resident page to evict
+static inline __attribute__((always_inline)) int select_victim_kernel(struct vm_sim *sim, enum policy policy)
+{
+    switch (policy)
+    {
+    case POLICY_OPT:
+        return opt(sim);
+    case POLICY_NRU:
+        return nru(sim);
+    case POLICY_CLOCK:
+        return clock_algorithm(sim);
+    }
+
+    perror("Invalid algorithm specified");
+    return -1;
+}
+
+int select_victim(struct vm_sim *sim)
+{
+    return select_victim_kernel(sim, sim->policy);
+}
+
+// Take a resident page out of memory without any write back (the caller accounts for where it goes)
+void release_frame(struct vm_sim *sim, int page_number)
+{
+    struct page_table_entry *evicted_entry = &sim->page_table[page_number];
+
+    if (evicted_entry->clock_node != NULL)
+    {
+        remove_node(&sim->clock_list, evicted_entry->clock_node);
+        evicted_entry->clock_node = NULL;
+    }
+
+    // Move the last allocated frame into the hole so the frame table stays packed
+    sim->frames_allocated--;
+    int moved_page = sim->frame_table[sim->frames_allocated];
+    sim->frame_table[evicted_entry->frame] = moved_page;
+    sim->page_table[moved_page].frame = evicted_entry->frame;
+
+    // Clean up the evicted frame
+    evicted_entry->valid = 0;
+    evicted_entry->ref = 0;
+    evicted_entry->dirty = 0;
+}
+
+// Evict a resident page, writing it to disk if dirty and releasing its frame
+void evict_page(struct vm_sim *sim, int page_number)
+{
+    // If the evicted page is dirty, write to disk
+    if (sim->page_table[page_number].dirty)
+    {
+        sim->writes++;
+        if (sim->profile != NULL)
+        {
+            profile_dirty_eviction(sim->profile, page_number);
+        }
+    }
+
+    release_frame(sim, page_number);
+}
+
+// Policy regret against opt
+// begin implementation
+// Every eviction is compared with the page opt would have evicted from the same resident
+// set: the one whose next use is furthest away. An eviction matches when the victim is
+// not needed before opt's victim would be. Otherwise it is regretted, and scored by how
+// soon the victim comes back and by how much sooner than opt's victim (when that one
+// comes back at all). An opt simulation runs in lockstep for the fault totals.
+#define REGRET_TOP_PAGES 10
+
+struct regret_window
+{
+    long long start_faults;     // Faults of the simulation when the window opened
+    long long start_opt_faults; // Faults of the opt simulation when the window opened
+    long long evictions;
+    long long matches;
+    long long opt_never;        // Regretted evictions where opt's victim is never used again
+    long long delta_sum;        // Records by which the other regretted victims came back sooner
+};
+
+struct policy_regret
+{
+    struct vm_sim *opt;          // The opt simulation running in lockstep
+    long long evictions;
+    long long matches;
+    long long opt_never;
+    long long delta_sum;
+    unsigned int reuse_hist[IRG_BUCKETS]; // Regretted evictions by power of two records until the victim's next use
+    struct regret_window *windows;
+    int window;                  // The window being filled
+    long long window_length;     // Records per window
+    struct cm_sketch regretted;  // Regretted evictions per page
+    struct topk pages;           // Pages evicted with the most regret
+};
+
+struct policy_regret *create_regret(struct vm_sim *opt_sim, long long records)
+{
+    struct policy_regret *regret = (struct policy_regret *)calloc(1, sizeof(struct policy_regret));
+    if (!regret)
+    {
+        perror("Failed to allocate memory for regret analysis");
+        exit(EXIT_FAILURE);
+    }
+    regret->windows = (struct regret_window *)calloc(regret_windows, sizeof(struct regret_window));
+    if (!regret->windows)
+    {
+        perror("Failed to allocate memory for regret analysis");
+        exit(EXIT_FAILURE);
+    }
+    regret->opt = opt_sim;
+    regret->window_length = (records + regret_windows - 1) / regret_windows;
+    if (regret->window_length == 0)
+    {
+        regret->window_length = 1;
+    }
+    topk_init(&regret->pages, REGRET_TOP_PAGES * TOPK_OVERSAMPLE);
+    return regret;
+}
+
+void free_regret(struct policy_regret *regret)
+{
+    if (regret == NULL)
+    {
+        return;
+    }
+    topk_free(&regret->pages);
+    free(regret->windows);
+    free(regret);
+}
+
+// Score the simulation's choice of `victim` before it is evicted at `line_num`
+void record_regret(struct vm_sim *sim, int victim, long long line_num)
+{
+    struct policy_regret *regret = sim->regret;
+    struct regret_window *window = &regret->windows[regret->window];
+    unsigned int best_next = sim->next_use[opt(sim)];
+    unsigned int victim_next = sim->next_use[victim];
+
+    regret->evictions++;
+    window->evictions++;
+    if (next_use_time(victim_next) == next_use_time(best_next))
+    {
+        regret->matches++;
+        window->matches++;
+        return;
+    }
+
+    if (best_next == NEXT_USE_NEVER)
+    {
+        regret->opt_never++;
+        window->opt_never++;
+    }
+    else
+    {
+        regret->delta_sum += best_next - victim_next;
+        window->delta_sum += best_next - victim_next;
+    }
+
+    int bucket = irg_bucket(victim_next - line_num);
+    regret->reuse_hist[bucket]++;
+
+    unsigned int estimate = sketch_add(&regret->regretted, victim);
+    struct topk_entry *entry = topk_offer(&regret->pages, victim, estimate);
+    if (entry != NULL)
+    {
+        entry->irg[bucket]++; // The gap histogram holds how soon this page came back
+    }
+}
+
+// Move on to the window holding `line_num`, once the trace has gone past the current one
+void update_regret_window(struct vm_sim *sim, long long line_num)
+{
+    struct policy_regret *regret = sim->regret;
+    while (regret->window < regret_windows - 1 && line_num >= (regret->window + 1) * regret->window_length)
+    {
+        regret->window++;
+        regret->windows[regret->window].start_faults = sim->page_faults;
+        regret->windows[regret->window].start_opt_faults = regret->opt->page_faults;
+    }
+}
+
+void print_regret(struct vm_sim *sim)
+{
+    struct policy_regret *regret = sim->regret;
+    long long regretted = regret->evictions - regret->matches;
+    long long opt_faults = regret->opt->page_faults;
+
+    printf("\nRegret against opt (%s):#######################################\n", sim->algorithm);
+    printf("Evictions: %lld, matching opt: %lld (%.2f%%), regretted: %lld\n",
+           regret->evictions, regret->matches,
+           regret->evictions ? 100.0 * regret->matches / regret->evictions : 0.0, regretted);
+    printf("Regretted victims came back after a median of <=%lld records\n", irg_median(regret->reuse_hist));
+    printf("Opt's victim never came back for %lld of them, the others came back %.1f records sooner on average\n",
+           regret->opt_never,
+           regretted > regret->opt_never ? (double)regret->delta_sum / (regretted - regret->opt_never) : 0.0);
+    printf("Faults: %lld, opt: %lld, excess: %lld (%+.2f%%)\n",
+           sim->page_faults, opt_faults, sim->page_faults - opt_faults,
+           opt_faults ? 100.0 * (sim->page_faults - opt_faults) / opt_faults : 0.0);
+
+    printf("%-6s %-23s %9s %9s %9s %7s %9s %10s\n",
+           "Window", "Records", "Faults", "OptFaults", "Evictions", "Match%", "OptNever", "MeanDelta");
+    for (int i = 0; i <= regret->window; i++)
+    {
+        struct regret_window *window = &regret->windows[i];
+        long long end_faults = i < regret->window ? regret->windows[i + 1].start_faults : sim->page_faults;
+        long long end_opt_faults = i < regret->window ? regret->windows[i + 1].start_opt_faults : opt_faults;
+        long long compared = window->evictions - window->matches - window->opt_never;
+        long long end = (i + 1) * regret->window_length < next_use_index.records ? (i + 1) * regret->window_length : next_use_index.records;
+        char range[32];
+        snprintf(range, sizeof(range), "%lld-%lld", i * regret->window_length, end - 1);
+        printf("%-6d %-23s %9lld %9lld %9lld %6.2f%% %9lld %10.1f\n",
+               i + 1, range, end_faults - window->start_faults, end_opt_faults - window->start_opt_faults,
+               window->evictions, window->evictions ? 100.0 * window->matches / window->evictions : 0.0,
+               window->opt_never, compared ? (double)window->delta_sum / compared : 0.0);
+    }
+
+    // Regretted evictions take the place of faults in the rows
+    struct topk *t = &regret->pages;
+    struct topk_report_row *rows = rank_topk(t, NULL, &regret->regretted, compare_by_faults);
+    if (!rows)
+    {
+        return;
+    }
+
+    printf("\nMost regretted evictions (%s):\n", sim->algorithm);
+    printf("%-4s %8s %-17s %10s %12s\n", "Rank", "Page", "Address range", "Regretted", "MedianReuse");
+    for (int i = 0; i < t->size && i < REGRET_TOP_PAGES; i++)
+    {
+        struct topk_entry *entry = rows[i].entry;
+        __uint32_t start = (__uint32_t)entry->page_number << 11;
+        char median_text[24];
+        snprintf(median_text, sizeof(median_text), "<=%lld", irg_median(entry->irg));
+        printf("%-4d %8x %08x-%08x %10u %12s\n",
+               i + 1, entry->page_number, start, start + PAGE_SIZE - 1, rows[i].faults, median_text);
+    }
+    free(rows);
+}
+// end implementation
+
+// Frame budget schedule and page-fault-frequency control
+// begin implementation
+static struct budget_event *schedule = NULL;
+static int schedule_len = 0;
+
+static int pff_enabled = 0;
+static double pff_low = 0.0;  // Shrink when the window fault rate drops below this
+static double pff_high = 0.0; // Grow when the window fault rate rises above this
+static int pff_min = 1;
+static int pff_max = TABLE_ENTRIES;
+
+// Fault rate is sampled over fixed windows of accesses
+static int window_size = 1000;
+
+// qsort is not stable, so ties on the access point fall back to the input order
+int compare_budget_events(const void *a, const void *b)
+{
+    const struct budget_event *x = (const struct budget_event *)a;
+    const struct budget_event *y = (const struct budget_event *)b;
+    if (x->access != y->access)
+    {
+        return x->access < y->access ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+void add_budget_event(int access, int frames)
+{
+    if (access < 0 || frames <= 0)
+    {
+        fprintf(stderr, "Invalid schedule entry %d:%d: access must be >= 0 and frames > 0.\n", access, frames);
+        exit(EXIT_FAILURE);
+    }
+
+    struct budget_event *grown = (struct budget_event *)realloc(schedule, (schedule_len + 1) * sizeof(struct budget_event));
+    if (!grown)
+    {
+        perror("Failed to allocate memory for schedule");
+        exit(EXIT_FAILURE);
+    }
+    schedule = grown;
+    schedule[schedule_len].access = access;
+    schedule[schedule_len].frames = frames;
+    schedule[schedule_len].order = schedule_len;
+    schedule_len++;
+}
+
+// Parse a schedule given inline as "N:M,N:M,..." or as a file with one "N M" pair per line
+int load_schedule(char *spec)
+{
+    int access, frames;
+    if (strchr(spec, ':') != NULL)
+    {
+        char *entry = strtok(spec, ",");
+        while (entry != NULL)
+        {
+            if (sscanf(entry, "%d:%d", &access, &frames) != 2)
+            {
+                fprintf(stderr, "Invalid schedule entry: %s\n", entry);
+                return -1;
+            }
+            add_budget_event(access, frames);
+            entry = strtok(NULL, ",");
+        }
+    }
+    else
+    {
+        FILE *f = fopen(spec, "r");
+        if (f == NULL)
+        {
+            perror("Failed to open schedule file");
+            return -1;
+        }
+        char line[128];
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            if (sscanf(line, "%d %d", &access, &frames) == 2)
+            {
+                add_budget_event(access, frames);
+            }
+        }
+        fclose(f);
+    }
+
+    qsort(schedule, schedule_len, sizeof(struct budget_event), compare_budget_events);
+    return 0;
+}
+
+// Parse "<window>:<low>:<high>[:<min>:<max>]"
+int parse_pff(char *spec)
+{
+    int fields = sscanf(spec, "%d:%lf:%lf:%d:%d", &window_size, &pff_low, &pff_high, &pff_min, &pff_max);
+    if (fields != 3 && fields != 5)
+    {
+        return -1;
+    }
+    if (window_size <= 0 || pff_low < 0 || pff_high < pff_low || pff_min <= 0 || pff_max < pff_min)
+    {
+        return -1;
+    }
+    pff_enabled = 1;
+    return 0;
+}
+
+int tracking_phases()
+{
+    return schedule_len > 0 || pff_enabled;
+}
+
+void end_phase(struct vm_sim *sim)
+{
+    struct phase_stats *phase = &sim->phases[sim->phase_count - 1];
+    phase->end_access = sim->total_accesses;
+    phase->end_faults = sim->page_faults;
+    phase->end_writes = sim->writes;
+}
+
+void begin_phase(struct vm_sim *sim, char source, int prev_frames)
+{
+    if (sim->phase_count == sim->phase_capacity)
+    {
+        sim->phase_capacity = sim->phase_capacity ? sim->phase_capacity * 2 : 16;
+        struct phase_stats *grown = (struct phase_stats *)realloc(sim->phases, sim->phase_capacity * sizeof(struct phase_stats));
+        if (!grown)
+        {
+            perror("Failed to allocate memory for phase stats");
+            exit(EXIT_FAILURE);
+        }
+        sim->phases = grown;
+    }
+
+    // Close the previous phase
+    if (sim->phase_count > 0)
+    {
+        end_phase(sim);
+    }
+
+    struct phase_stats *phase = &sim->phases[sim->phase_count++];
+    memset(phase, 0, sizeof(struct phase_stats));
+    phase->source = source;
+    phase->start_access = sim->total_accesses;
+    phase->frames = sim->num_of_frames;
+    phase->prev_frames = prev_frames;
+    phase->start_faults = sim->page_faults;
+    phase->start_writes = sim->writes;
+    phase->recovered_after = -1;
+
+    // Without a full window yet, fall back to the rate observed so far
+    if (sim->last_window_rate >= 0)
+    {
+        phase->baseline_rate = sim->last_window_rate;
+    }
+    else
+    {
+        phase->baseline_rate = sim->total_accesses ? (double)sim->page_faults / sim->total_accesses : 0.0;
+    }
+}
+
+// Change the number of frames mid-trace. Shrinking evicts the surplus through the
+// algorithm's victim selection; growing makes the new frames available at once.
+void set_frame_budget(struct vm_sim *sim, int new_frames, long long line_num, char source)
+{
+    if (new_frames == sim->num_of_frames)
+    {
+        return;
+    }
+
+    int prev_frames = sim->num_of_frames;
+    sim->num_of_frames = new_frames;
+    reserve_frames(sim, sim->num_of_frames);
+    begin_phase(sim, source, prev_frames);
+
+    struct phase_stats *phase = &sim->phases[sim->phase_count - 1];
+    while (sim->frames_allocated > sim->num_of_frames)
+    {
+        int to_be_evicted = select_victim(sim);
+        if (to_be_evicted < 0)
+        {
+            perror("Failed to select a page to evict while shrinking");
+            break;
+        }
+        if (sim->regret != NULL)
+        {
+            record_regret(sim, to_be_evicted, line_num);
+        }
+        int was_dirty = sim->page_table[to_be_evicted].dirty;
+        evict_page(sim, to_be_evicted);
+        phase->bulk_evictions++;
+        phase->bulk_writes += was_dirty;
+    }
+
+    // Start a fresh fault rate window under the new budget
+    sim->window_start_access = sim->total_accesses;
+    sim->window_start_faults = sim->page_faults;
+}
+
+// Apply every scheduled budget change due at the current access
+void apply_schedule(struct vm_sim *sim, long long line_num)
+{
+    while (sim->next_event < schedule_len && schedule[sim->next_event].access <= sim->total_accesses)
+    {
+        set_frame_budget(sim, schedule[sim->next_event].frames, line_num, 's');
+        sim->next_event++;
+    }
+}
+
+// Close the fault rate window once it is full: check shrink recovery and run PFF control
+void update_window(struct vm_sim *sim, long long line_num)
+{
+    long long window_accesses = sim->total_accesses - sim->window_start_access;
+    if (window_accesses < window_size)
+    {
+        return;
+    }
+
+    double rate = (double)(sim->page_faults - sim->window_start_faults) / window_accesses;
+    struct phase_stats *phase = &sim->phases[sim->phase_count - 1];
+    if (phase->frames < phase->prev_frames && phase->recovered_after == -1 && rate <= phase->baseline_rate)
+    {
+        phase->recovered_after = sim->total_accesses - phase->start_access;
+    }
+
+    sim->last_window_rate = rate;
+    sim->window_start_access = sim->total_accesses;
+    sim->window_start_faults = sim->page_faults;
+
+    if (pff_enabled)
+    {
+        int frames = sim->num_of_frames;
+        int step = frames / 8 > 0 ? frames / 8 : 1;
+        if (rate > pff_high && frames < pff_max)
+        {
+            set_frame_budget(sim, frames + step < pff_max ? frames + step : pff_max, line_num, 'p');
+        }
+        else if (rate < pff_low && frames > pff_min)
+        {
+            set_frame_budget(sim, frames - step > pff_min ? frames - step : pff_min, line_num, 'p');
+        }
+    }
+}
+// end implementation
+
+// Simulation kernels
+// begin implementation
+// Feed one valid trace record to a simulation. The generic path passes the simulation's
+// runtime policy; the specialised kernels below pass a constant, so each one is compiled
+// with only its own algorithm's hit, fault and eviction code inlined.
+static inline __attribute__((always_inline)) void access_kernel(struct vm_sim *sim, char instruction_type, int page_number, long long line_num, enum policy policy)
+{
+    // Apply frame budget changes that are due before this access
+    if (schedule_len > 0)
+    {
+        apply_schedule(sim, line_num);
+    }
+
+    if (instruction_type == 'M') /* Modify counts as two mem accesses */
+    {
+        sim->total_accesses += 2;
+    }
+    else
+    {
+        sim->total_accesses++;
+    }
+
+    // Periodically clear the reference bits for NRU
+    if (policy == POLICY_NRU && line_num % refresh_rate == 0)
+    {
+        nru_refresh(sim);
+    }
+
+    // Find page table entry
+    struct page_table_entry *entry = &sim->page_table[page_number];
+
+    if (sim->profile != NULL)
+    {
+        profile_access(sim->profile, entry, page_number, line_num);
+    }
+
+    // The page's next use moves on, before any victim is picked
+    if (policy == POLICY_OPT || sim->next_use != NULL)
+    {
+        sim->next_use[page_number] = next_use_at(line_num);
+    }
+
+    // if the page is invalid, allocate a frame
+    if (!entry->valid)
+    {
+        sim->page_faults++;                              /* Accessing an invalid page causes a page fault */
+        if (sim->profile != NULL)
+        {
+            profile_fault(sim->profile, page_number);
+        }
+        if (sim->frames_allocated >= sim->num_of_frames) /* If there is not any frame available, then we have to evict an existing frame */
+        {
+            //  Evict a frame using an algorithm opt, nru, clock.
+            int to_be_evicted = select_victim_kernel(sim, policy); /* Page number to be evicted */
+            if (to_be_evicted < 0)                           /* If the evicted page is not a positive int, then we're doing smth wrong */
+            {
+                fprintf(stderr, "Invalid page number to be evicted: %d\nTerminating\n", to_be_evicted);
+                exit(EXIT_FAILURE);
+            }
+            if (sim->regret != NULL)
+            {
+                record_regret(sim, to_be_evicted, line_num);
+            }
+            evict_page(sim, to_be_evicted);
+        }
+
+        // Allocate the page in the free frame
+        allocate_page_kernel(sim, instruction_type, page_number, policy);
+    }
+    else
+    {
+        // PAGE HIT!
+        entry->ref = 1;
+        if (instruction_type == 'S' || instruction_type == 'M')
+        {
+            entry->dirty = 1;
+        }
+    }
+
+    if (tracking_phases())
+    {
+        update_window(sim, line_num);
+    }
+}
+
+// A run of consecutive trace records to the same page, collapsed into one
+struct trace_run
+{
+    char instruction_type;  // Type of the first record
+    int page_number;
+    int records;            // Records collapsed into the run
+    int accesses;           // Accesses they count for (M counts as two)
+    int dirty;              // Any record in the run was a store or modify
+};
+
+// Apply the records after the first one of a run. They can only be hits on the page the first
+// record just brought in, so they reduce to the counters, the page's bits and any NRU refresh
+// that would have fallen between them. Runs are never collapsed while phases are tracked,
+// since budget changes and fault rate windows act between individual records.
+static inline __attribute__((always_inline)) void repeat_kernel(struct vm_sim *sim, struct trace_run *run, long long line_num, enum policy policy)
+{
+    struct page_table_entry *entry = &sim->page_table[run->page_number];
+    sim->total_accesses += run->accesses - (run->instruction_type == 'M' ? 2 : 1);
+
+    // A refresh on a later record clears every reference bit, after which that record sets this page's again
+    if (policy == POLICY_NRU)
+    {
+        long long next_refresh = (line_num / refresh_rate + 1) * refresh_rate;
+        if (next_refresh < line_num + run->records)
+        {
+            nru_refresh(sim);
+        }
+    }
+
+    entry->ref = 1;
+    entry->dirty |= run->dirty;
+    if (policy == POLICY_OPT || sim->next_use != NULL)
+    {
+        sim->next_use[run->page_number] = next_use_at(line_num + run->records - 1);
+    }
+
+    if (sim->profile != NULL)
+    {
+        for (int i = 1; i < run->records; i++)
+        {
+            profile_access(sim->profile, entry, run->page_number, line_num + i);
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void run_kernel(struct vm_sim *sim, struct trace_run *run, long long line_num, enum policy policy)
+{
+    access_kernel(sim, run->instruction_type, run->page_number, line_num, policy);
+    if (run->records > 1)
+    {
+        repeat_kernel(sim, run, line_num, policy);
+    }
+}
+
+// Generic step, dispatching on the simulation's policy at runtime
+void simulate_access(struct vm_sim *sim, char instruction_type, int page_number, long long line_num)
+{
+    access_kernel(sim, instruction_type, page_number, line_num, sim->policy);
+}
+
+void simulate_run(struct vm_sim *sim, struct trace_run *run, long long line_num)
+{
+    run_kernel(sim, run, line_num, sim->policy);
+}
+
+// A trace record already parsed and validated, for running a kernel over memory
+struct trace_record
+{
+    char instruction_type;
+    int page_number;
+};
+
+// The generic loop: one call and a runtime policy dispatch per access
+void run_records_generic(struct vm_sim *sim, struct trace_record *records, long long count)
+{
+    for (long long i = 0; i < count; i++)
+    {
+        simulate_access(sim, records[i].instruction_type, records[i].page_number, i);
+    }
+}
+
+// Specialised loops, one per algorithm, with the whole step inlined
+void run_records_opt(struct vm_sim *sim, struct trace_record *records, long long count)
+{
+    for (long long i = 0; i < count; i++)
+    {
+        access_kernel(sim, records[i].instruction_type, records[i].page_number, i, POLICY_OPT);
+    }
+}
+
+void run_records_nru(struct vm_sim *sim, struct trace_record *records, long long count)
+{
+    for (long long i = 0; i < count; i++)
+    {
+        access_kernel(sim, records[i].instruction_type, records[i].page_number, i, POLICY_NRU);
+    }
+}
+
+void run_records_clock(struct vm_sim *sim, struct trace_record *records, long long count)
+{
+    for (long long i = 0; i < count; i++)
+    {
+        access_kernel(sim, records[i].instruction_type, records[i].page_number, i, POLICY_CLOCK);
+    }
+}
+
+// Pick the specialised loop for an algorithm, falling back to the generic one
+void (*specialised_loop(enum policy policy))(struct vm_sim *, struct trace_record *, long long)
+{
+    switch (policy)
+    {
+    case POLICY_OPT:
+        return run_records_opt;
+    case POLICY_NRU:
+        return run_records_nru;
+    case POLICY_CLOCK:
+        return run_records_clock;
+    }
+    return run_records_generic;
+}
+// end implementation
+
+// Tiered memory
+// begin implementation
+// A fast tier (the -n frames) backed by a slower capacity tier (-t frames). Pages
+// fault into the fast tier; fast tier victims are demoted to the slow tier instead
+// of being written out, and only slow tier victims go to disk. Slow tier pages are
+// promoted back by the promotion policy. Each tier runs its own replacement algorithm.
+enum promotion
+{
+    PROMOTE_FIRST, // On the first access in the slow tier
+    PROMOTE_COUNT, // After promotion_param accesses in the slow tier
+    PROMOTE_SCAN   // Every promotion_param accesses, promote slow pages referenced since the last scan
+};
+
+static int slow_frames = 0;          // Frames in the slow tier, 0 disables tiering
+static char *slow_algorithm = NULL;  // Slow tier algorithm, defaults to the fast tier's
+static int fast_latency_ns = 100;
+static int slow_latency_ns = 300;
+static int fault_latency_ns = 100000;
+static enum promotion promotion = PROMOTE_FIRST;
+static int promotion_param = 0;
+
+struct tiered_sim
+{
+    struct vm_sim fast;
+    struct vm_sim slow;
+
+    long long total_accesses;
+    long long fast_hits;      // Accesses served by the fast tier
+    long long slow_hits;      // Accesses served by the slow tier
+    long long fault_accesses; // Accesses that had to wait for disk
+    long long page_faults;
+    long long promotions;
+    long long demotions;
+
+    long long since_scan;
+    int *scan_buffer;         // Slow tier pages picked by the current scan
+};
+
+// Parse "<frames>[:<algorithm>]"
+int parse_slow_tier(char *spec)
+{
+    char *colon = strchr(spec, ':');
+    if (colon != NULL)
+    {
+        *colon = '\0';
+        slow_algorithm = colon + 1;
+    }
+    slow_frames = atoi(spec);
+    return slow_frames > 0 ? 0 : -1;
+}
+
+// Parse "<fast ns>:<slow ns>:<fault ns>"
+int parse_latencies(char *spec)
+{
+    if (sscanf(spec, "%d:%d:%d", &fast_latency_ns, &slow_latency_ns, &fault_latency_ns) != 3)
+    {
+        return -1;
+    }
+    return fast_latency_ns >= 0 && slow_latency_ns >= 0 && fault_latency_ns >= 0 ? 0 : -1;
+}
+
+// Parse "first", "count:<N>" or "scan:<N>"
+int parse_promotion(char *spec)
+{
+    if (strcmp(spec, "first") == 0)
+    {
+        promotion = PROMOTE_FIRST;
+        return 0;
+    }
+    if (sscanf(spec, "count:%d", &promotion_param) == 1)
+    {
+        promotion = PROMOTE_COUNT;
+    }
+    else if (sscanf(spec, "scan:%d", &promotion_param) == 1)
+    {
+        promotion = PROMOTE_SCAN;
+    }
+    else
+    {
+        return -1;
+    }
+    return promotion_param > 0 ? 0 : -1;
+}
+
+void init_tiered_sim(struct tiered_sim *ts, char *fast_name, enum policy fast_policy, char *slow_name, enum policy slow_policy)
+{
+    memset(ts, 0, sizeof(struct tiered_sim));
+    init_sim(&ts->fast, fast_name, fast_policy);
+    init_sim(&ts->slow, slow_name, slow_policy);
+    ts->slow.num_of_frames = slow_frames;
+    reserve_frames(&ts->slow, slow_frames);
+
+    ts->scan_buffer = (int *)malloc(slow_frames * sizeof(int));
+    if (!ts->scan_buffer)
+    {
+        perror("Failed to allocate memory for promotion scan");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void free_tiered_sim(struct tiered_sim *ts)
+{
+    free_sim(&ts->fast);
+    free_sim(&ts->slow);
+    free(ts->scan_buffer);
+}
+
+// Move a fast tier victim down to the slow tier, evicting a slow tier page to disk if it is full
+void demote_page(struct tiered_sim *ts)
+{
+    int to_be_demoted = select_victim(&ts->fast);
+    if (to_be_demoted < 0)
+    {
+        fprintf(stderr, "Invalid page number to be demoted: %d\nTerminating\n", to_be_demoted);
+        exit(EXIT_FAILURE);
+    }
+    int dirty = ts->fast.page_table[to_be_demoted].dirty;
+    release_frame(&ts->fast, to_be_demoted);
+
+    if (ts->slow.frames_allocated >= ts->slow.num_of_frames)
+    {
+        int to_be_evicted = select_victim(&ts->slow);
+        if (to_be_evicted < 0)
+        {
+            fprintf(stderr, "Invalid page number to be evicted: %d\nTerminating\n", to_be_evicted);
+            exit(EXIT_FAILURE);
+        }
+        evict_page(&ts->slow, to_be_evicted);
+    }
+
+    // The page keeps its dirty data, and arrives unreferenced since it just lost the fast tier
+    allocate_page(&ts->slow, 'L', to_be_demoted);
+    ts->slow.page_table[to_be_demoted].resident_hits = 0;
+    ts->slow.page_table[to_be_demoted].dirty = dirty;
+    ts->slow.page_table[to_be_demoted].ref = 0;
+    ts->demotions++;
+}
+
+// Make room in the fast tier if needed and load the page there
+void place_in_fast_tier(struct tiered_sim *ts, char instruction_type, int page_number)
+{
+    if (ts->fast.frames_allocated >= ts->fast.num_of_frames)
+    {
+        demote_page(ts);
+    }
+    allocate_page(&ts->fast, instruction_type, page_number);
+}
+
+// Move a slow tier page up; the fast tier victim takes the frame it frees in the slow tier
+void promote_page(struct tiered_sim *ts, int page_number)
+{
+    int dirty = ts->slow.page_table[page_number].dirty;
+    release_frame(&ts->slow, page_number);
+    place_in_fast_tier(ts, 'L', page_number);
+    ts->fast.page_table[page_number].dirty = dirty;
+    ts->promotions++;
+}
+
+// Hotness scan: promote slow tier pages referenced since the previous scan, at most a fast tier's worth
+void scan_slow_tier(struct tiered_sim *ts)
+{
+    int picked = 0;
+    for (int i = 0; i < ts->slow.frames_allocated && picked < ts->fast.num_of_frames; i++)
+    {
+        int page_number = ts->slow.frame_table[i];
+        if (ts->slow.page_table[page_number].ref)
+        {
+            ts->scan_buffer[picked++] = page_number;
+        }
+    }
+
+    for (int i = 0; i < picked; i++)
+    {
+        // An earlier promotion in this scan may have demoted a page over it; it is still in the slow tier either way
+        if (ts->slow.page_table[ts->scan_buffer[i]].valid)
+        {
+            promote_page(ts, ts->scan_buffer[i]);
+        }
+    }
+
+    // Start the next scan period with clean reference bits
+    nru_refresh(&ts->slow);
+}
+
+// Feed one valid trace record to a tiered simulation
+void simulate_tiered_access(struct tiered_sim *ts, char instruction_type, int page_number, long long line_num)
+{
+    int weight = instruction_type == 'M' ? 2 : 1; /* Modify counts as two mem accesses */
+    int is_write = instruction_type == 'S' || instruction_type == 'M';
+    ts->total_accesses += weight;
+
+    // Periodically clear the reference bits for NRU
+    if ((ts->fast.policy == POLICY_NRU || ts->slow.policy == POLICY_NRU) && line_num % refresh_rate == 0)
+    {
+        if (ts->fast.policy == POLICY_NRU)
+        {
+            nru_refresh(&ts->fast);
+        }
+        if (ts->slow.policy == POLICY_NRU)
+        {
+            nru_refresh(&ts->slow);
+        }
+    }
+
+    // Either tier may run opt, and a page can move between them
+    if (ts->fast.next_use != NULL)
+    {
+        ts->fast.next_use[page_number] = next_use_at(line_num);
+    }
+    if (ts->slow.next_use != NULL)
+    {
+        ts->slow.next_use[page_number] = next_use_at(line_num);
+    }
+
+    struct page_table_entry *fast_entry = &ts->fast.page_table[page_number];
+    struct page_table_entry *slow_entry = &ts->slow.page_table[page_number];
+    if (fast_entry->valid)
+    {
+        ts->fast_hits += weight;
+        fast_entry->ref = 1;
+        fast_entry->dirty |= is_write;
+    }
+    else if (slow_entry->valid)
+    {
+        ts->slow_hits += weight;
+        slow_entry->ref = 1;
+        slow_entry->dirty |= is_write;
+        slow_entry->resident_hits++;
+
+        if (promotion == PROMOTE_FIRST || (promotion == PROMOTE_COUNT && slow_entry->resident_hits >= (unsigned int)promotion_param))
+        {
+            promote_page(ts, page_number);
+        }
+    }
+    else
+    {
+        ts->fault_accesses += weight;
+        ts->page_faults++;
+        place_in_fast_tier(ts, instruction_type, page_number);
+    }
+
+    if (promotion == PROMOTE_SCAN)
+    {
+        ts->since_scan += weight;
+        if (ts->since_scan >= promotion_param)
+        {
+            ts->since_scan = 0;
+            scan_slow_tier(ts);
+        }
+    }
+}
+
+void print_tiered_stats(struct tiered_sim *ts)
+{
+    long long total = ts->total_accesses > 0 ? ts->total_accesses : 1;
+    double eat = ((double)ts->fast_hits * fast_latency_ns +
+                  (double)ts->slow_hits * slow_latency_ns +
+                  (double)ts->fault_accesses * (fault_latency_ns + fast_latency_ns)) / total;
+    long long migrations = ts->promotions + ts->demotions;
+
+    printf("\n\n\nTiered Stats:################################################\n");
+    printf("Algorithm: %s (fast) / %s (slow)\n", ts->fast.algorithm, ts->slow.algorithm);
+    printf("Fast Tier Frames: %d\n", ts->fast.num_of_frames);
+    printf("Slow Tier Frames: %d\n", ts->slow.num_of_frames);
+    if (promotion == PROMOTE_FIRST)
+    {
+        printf("Promotion: on first slow tier access\n");
+    }
+    else
+    {
+        printf("Promotion: %s %d accesses\n", promotion == PROMOTE_COUNT ? "after" : "scan every", promotion_param);
+    }
+    printf("Total Accesses: %lld\n", ts->total_accesses);
+    printf("Fast Tier Hits: %lld (%.2f%%)\n", ts->fast_hits, 100.0 * ts->fast_hits / total);
+    printf("Slow Tier Hits: %lld (%.2f%%)\n", ts->slow_hits, 100.0 * ts->slow_hits / total);
+    printf("Page Faults: %lld (%.2f%% of accesses)\n", ts->page_faults, 100.0 * ts->fault_accesses / total);
+    printf("Promotions: %lld\n", ts->promotions);
+    printf("Demotions: %lld\n", ts->demotions);
+    printf("Migration Traffic: %lld pages (%lld KB)\n", migrations, migrations * PAGE_SIZE / 1024);
+    printf("Writes: %lld\n", ts->slow.writes);
+    printf("Effective Access Time: %.1f ns (fast %d ns, slow %d ns, fault %d ns)\n", eat, fast_latency_ns, slow_latency_ns, fault_latency_ns);
+}
+// end implementation
+
+// Shared-memory trace ring
+// begin implementation
+// A single-producer single-consumer ring of parsed trace records in a POSIX shared
+// memory object. A relay (vmsim -R <name>) parses Lackey output into it and the
+// simulator drains it, so live traces never touch the disk.
+struct trace_ring
+{
+    _Atomic unsigned int magic;
+    unsigned int slots;
+    _Atomic unsigned long long head __attribute__((aligned(64))); // Next slot the relay writes
+    _Atomic unsigned long long tail __attribute__((aligned(64))); // Next slot the simulator reads
+    _Atomic int closed;              // Set by the relay once its input is exhausted
+    _Atomic int consumer_pid;        // The simulator reading the ring, 0 until one attaches
+    _Atomic int detached;            // Set by the simulator once it stops reading
+    struct tuple records[RING_SLOTS];
+};
+
+struct trace_ring *map_ring(char *name, int create)
+{
+    // A ring left behind by a run that crashed would hand its stale records to the next consumer
+    if (create)
+    {
+        shm_unlink(name);
+    }
+
+    int fd = shm_open(name, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (create && ftruncate(fd, sizeof(struct trace_ring)) != 0)
+    {
+        perror("Failed to size trace ring");
+        close(fd);
+        return NULL;
+    }
+
+    // The relay creates the object before sizing it; mapping it in between would fault on first touch
+    struct stat st;
+    if (!create && (fstat(fd, &st) != 0 || st.st_size != (off_t)sizeof(struct trace_ring)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct trace_ring *ring = (struct trace_ring *)mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        perror("Failed to map trace ring");
+        return NULL;
+    }
+
+    if (create)
+    {
+        ring->slots = RING_SLOTS;
+        atomic_store(&ring->head, 0);
+        atomic_store(&ring->tail, 0);
+        atomic_store(&ring->closed, 0);
+        atomic_store(&ring->consumer_pid, 0);
+        atomic_store(&ring->detached, 0);
+        atomic_store_explicit(&ring->magic, RING_MAGIC, memory_order_release);
+    }
+    return ring;
+}
+
+// Relay mode: parse Lackey output from stdin into the ring named `name`
+// Whether nothing will drain the ring any more: the simulator detached, or its process is gone
+int ring_abandoned(struct trace_ring *ring)
+{
+    if (atomic_load_explicit(&ring->detached, memory_order_acquire))
+    {
+        return 1;
+    }
+    int pid = atomic_load_explicit(&ring->consumer_pid, memory_order_relaxed);
+    return pid != 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+int run_relay(char *name)
+{
+    struct trace_ring *ring = map_ring(name, 1);
+    if (ring == NULL)
+    {
+        perror("Failed to create trace ring");
+        return EXIT_FAILURE;
+    }
+
+    char line[128];
+    unsigned long long head = 0;
+    unsigned long long tail = 0; // Cached copy of the consumer's position
+    long long relayed = 0;
+    while (!stop_requested && fgets(line, sizeof(line), stdin) != NULL)
+    {
+        struct tuple mem_access = sanitize_trace_line(line);
+        if (mem_access.instruction_type == 'X')
+        {
+            continue;
+        }
+
+        // Wait for room; the traced program is throttled rather than memory growing
+        while (head - tail >= RING_SLOTS)
+        {
+            tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (head - tail < RING_SLOTS || stop_requested || ring_abandoned(ring))
+            {
+                break;
+            }
+            usleep(100);
+        }
+        if (head - tail >= RING_SLOTS)
+        {
+            break; // Stopped, or nobody is left to read the rest
+        }
+        ring->records[head & (RING_SLOTS - 1)] = mem_access;
+        head++;
+        relayed++;
+
+        // Publish every record, so the simulator sees the last accesses of a program that
+        // has gone idle. Only the relay writes the head's cache line, which keeps this cheap.
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+
+    if (ring_abandoned(ring))
+    {
+        fprintf(stderr, "The simulator stopped reading %s\n", name);
+    }
+    fprintf(stderr, "Relayed %lld records to %s\n", relayed, name);
+    munmap(ring, sizeof(struct trace_ring));
+    return EXIT_SUCCESS;
+}
+// end implementation
+
+// Trace input: a trace file, a pipe or FIFO ("-" for stdin), or a shared-memory ring ("shm:<name>")
+struct trace_source
+{
+    FILE *file;
+    struct trace_ring *ring;
+    char *ring_name;
+    unsigned long long ring_tail;
+    unsigned long long ring_head; // Cached copy of the relay's position
+    int seekable;                 // Only a regular file can be read twice (needed by opt)
+    int collapse;                 // Merge consecutive records to the same page into runs
+    int has_pending;              // A record read past the end of the previous run
+    char pending_type;
+    int pending_page;
+};
+
+int open_trace_source(struct trace_source *src, char *path)
+{
+    memset(src, 0, sizeof(struct trace_source));
+
+    if (strncmp(path, "shm:", 4) == 0)
+    {
+        src->ring_name = path + 4;
+
+        // The relay may not have started yet
+        while (!stop_requested && (src->ring = map_ring(src->ring_name, 0)) == NULL)
+        {
+            usleep(100000);
+        }
+        while (src->ring != NULL && !stop_requested && atomic_load_explicit(&src->ring->magic, memory_order_acquire) != RING_MAGIC)
+        {
+            usleep(1000);
+        }
+        if (src->ring == NULL)
+        {
+            return -1;
+        }
+        // Lets the relay tell that the simulator is gone, even if it crashes
+        atomic_store_explicit(&src->ring->consumer_pid, (int)getpid(), memory_order_relaxed);
+        return 0;
+    }
+
+    src->file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (src->file == NULL)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    src->seekable = fstat(fileno(src->file), &st) == 0 && S_ISREG(st.st_mode);
+    return 0;
+}
+
+void close_trace_source(struct trace_source *src)
+{
+    if (src->ring != NULL)
+    {
+        atomic_store_explicit(&src->ring->detached, 1, memory_order_release);
+        munmap(src->ring, sizeof(struct trace_ring));
+        shm_unlink(src->ring_name);
+    }
+    else if (src->file != NULL && src->file != stdin)
+    {
+        fclose(src->file);
+    }
+}
+
+// Fetch the next record from the source. Returns 0 once the trace has ended.
+int next_trace_record(struct trace_source *src, struct tuple *mem_access)
+{
+    if (src->ring == NULL)
+    {
+        char line[128];
+        if (fgets(line, sizeof(line), src->file) == NULL)
+        {
+            return 0;
+        }
+        *mem_access = sanitize_trace_line(line);
+        return 1;
+    }
+
+    while (src->ring_tail == src->ring_head)
+    {
+        int closed = atomic_load_explicit(&src->ring->closed, memory_order_acquire);
+        src->ring_head = atomic_load_explicit(&src->ring->head, memory_order_acquire);
+        if (src->ring_tail != src->ring_head)
+        {
+            break;
+        }
+        if (closed || stop_requested)
+        {
+            return 0;
+        }
+        usleep(100);
+    }
+
+    *mem_access = src->ring->records[src->ring_tail & (RING_SLOTS - 1)];
+    src->ring_tail++;
+    if ((src->ring_tail & 255) == 0 || src->ring_tail == src->ring_head)
+    {
+        atomic_store_explicit(&src->ring->tail, src->ring_tail, memory_order_release);
+    }
+    return 1;
+}
+
+// Fetch the next record that can be simulated, reporting and skipping malformed ones
+int next_valid_record(struct trace_source *src, char *instruction_type, int *page_number)
+{
+    struct tuple mem_access;
+    while (next_trace_record(src, &mem_access))
+    {
+        // Get the intruction type and page number
+        *instruction_type = mem_access.instruction_type;
+        *page_number = get_page_number(mem_access.add);
+
+        // Check that page number is in bounds, and that the instruction type is valid
+        if (*page_number < 0 || *page_number >= TABLE_ENTRIES || *instruction_type == 'X')
+        {
+            if (*page_number < 0)
+            {
+                perror("skipping line: negative page number.\n");
+            }
+
+            if (*page_number >= TABLE_ENTRIES)
+            {
+                perror("skipping line: page number out of bounds.\n");
+            }
+
+            if (*instruction_type == 'X')
+            {
+                perror("skipping line: invalid instruction type.\n");
+            }
+            continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Fetch the next run of records to one page. Lackey traces are full of them, e.g. instruction
+// fetches walking through a page, and each run costs one simulated access instead of many.
+int next_trace_run(struct trace_source *src, struct trace_run *run)
+{
+    char instruction_type;
+    int page_number;
+
+    if (src->has_pending)
+    {
+        instruction_type = src->pending_type;
+        page_number = src->pending_page;
+        src->has_pending = 0;
+    }
+    else if (!next_valid_record(src, &instruction_type, &page_number))
+    {
+        return 0;
+    }
+
+    run->instruction_type = instruction_type;
+    run->page_number = page_number;
+    run->records = 1;
+    run->accesses = instruction_type == 'M' ? 2 : 1;
+    run->dirty = instruction_type == 'S' || instruction_type == 'M';
+
+    while (src->collapse && run->records < INT_MAX / 2 && next_valid_record(src, &instruction_type, &page_number))
+    {
+        if (page_number != run->page_number)
+        {
+            src->pending_type = instruction_type;
+            src->pending_page = page_number;
+            src->has_pending = 1;
+            break;
+        }
+        run->records++;
+        run->accesses += instruction_type == 'M' ? 2 : 1;
+        run->dirty |= instruction_type == 'S' || instruction_type == 'M';
+    }
+    return 1;
+}
+
+void print_interval_stats(struct vm_sim *sims, int sim_count, struct tiered_sim *tiers, int tier_count, long long records)
+{
+    printf("[%lld records]", records);
+    for (int i = 0; i < tier_count; i++)
+    {
+        struct tiered_sim *ts = &tiers[i];
+        long long total = ts->total_accesses > 0 ? ts->total_accesses : 1;
+        printf(" %s/%s: fast_hit%%=%.2f slow_hit%%=%.2f faults=%lld migrations=%lld;",
+               ts->fast.algorithm, ts->slow.algorithm, 100.0 * ts->fast_hits / total, 100.0 * ts->slow_hits / total,
+               ts->page_faults, ts->promotions + ts->demotions);
+    }
+    for (int i = 0; i < sim_count; i++)
+    {
+        struct vm_sim *sim = &sims[i];
+        long long accesses = sim->total_accesses - sim->interval_start_accesses;
+        long long faults = sim->page_faults - sim->interval_start_faults;
+        printf(" %s: faults=%lld writes=%lld interval_fault%%=%.2f frames=%d;",
+               sim->algorithm, sim->page_faults, sim->writes,
+               accesses ? 100.0 * faults / accesses : 0.0, sim->num_of_frames);
+        sim->interval_start_accesses = sim->total_accesses;
+        sim->interval_start_faults = sim->page_faults;
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Records read and the runs they collapsed into
+static long long trace_records = 0;
+static long long trace_runs = 0;
+
+// Parse the trace once and feed every record to all simulations in lockstep. When
+// `specialised` is set (a constant in every caller) there is a single simulation and it
+// runs through `policy`'s kernel with no per-access dispatch.
+static inline __attribute__((always_inline)) void trace_loop(struct trace_source *src, struct vm_sim *sims, int sim_count, struct tiered_sim *tiers, int tier_count, enum policy policy, int specialised)
+{
+    if (tracking_phases())
+    {
+        for (int i = 0; i < sim_count; i++)
+        {
+            begin_phase(&sims[i], 'i', sims[i].num_of_frames);
+        }
+    }
+
+    struct trace_run run;
+    long long line_num = 0;
+    while (!stop_requested && next_trace_run(src, &run))
+    {
+        check_next_use_coverage(line_num + run.records);
+        if (specialised)
+        {
+            run_kernel(&sims[0], &run, line_num, policy);
+        }
+        else
+        {
+            for (int i = 0; i < sim_count; i++)
+            {
+                simulate_run(&sims[i], &run, line_num);
+            }
+
+            // Tiered runs are never collapsed, promotion acts between individual records
+            for (int i = 0; i < tier_count; i++)
+            {
+                simulate_tiered_access(&tiers[i], run.instruction_type, run.page_number, line_num);
+            }
+        }
+
+        // Advance the line number past the run
+        line_num += run.records;
+        trace_records += run.records;
+        trace_runs++;
+
+        if (stats_interval > 0 && line_num / stats_interval != (line_num - run.records) / stats_interval)
+        {
+            print_interval_stats(sims, sim_count, tiers, tier_count, line_num);
+        }
+
+        // Regret runs side by side with opt, so never through a specialised kernel
+        if (!specialised && regret_windows > 0)
+        {
+            for (int i = 0; i < sim_count; i++)
+            {
+                if (sims[i].regret != NULL)
+                {
+                    update_regret_window(&sims[i], line_num);
+                }
+            }
+        }
+    }
+
+    if (tracking_phases())
+    {
+        for (int i = 0; i < sim_count; i++)
+        {
+            end_phase(&sims[i]);
+        }
+    }
+}
+
+void trace_loop_generic(struct trace_source *src, struct vm_sim *sims, int sim_count, struct tiered_sim *tiers, int tier_count)
+{
+    trace_loop(src, sims, sim_count, tiers, tier_count, POLICY_OPT, 0);
+}
+
+void trace_loop_opt(struct trace_source *src, struct vm_sim *sim)
+{
+    trace_loop(src, sim, 1, NULL, 0, POLICY_OPT, 1);
+}
+
+void trace_loop_nru(struct trace_source *src, struct vm_sim *sim)
+{
+    trace_loop(src, sim, 1, NULL, 0, POLICY_NRU, 1);
+}
+
+void trace_loop_clock(struct trace_source *src, struct vm_sim *sim)
+{
+    trace_loop(src, sim, 1, NULL, 0, POLICY_CLOCK, 1);
+}
+
+// Pick the loop once: a lone simulation gets its algorithm's specialised kernel
+void process_trace_file(struct trace_source *src, struct vm_sim *sims, int sim_count, struct tiered_sim *tiers, int tier_count)
+{
+    if (sim_count == 1 && tier_count == 0)
+    {
+        switch (sims[0].policy)
+        {
+        case POLICY_OPT:
+            trace_loop_opt(src, &sims[0]);
+            return;
+        case POLICY_NRU:
+            trace_loop_nru(src, &sims[0]);
+            return;
+        case POLICY_CLOCK:
+            trace_loop_clock(src, &sims[0]);
+            return;
+        }
+    }
+    trace_loop_generic(src, sims, sim_count, tiers, tier_count);
+}
+
+// Kernel benchmark
+// begin implementation
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse and validate the whole trace into memory so the benchmark times simulation only
+struct trace_record *load_trace_records(struct trace_source *src, long long *count)
+{
+    long long capacity = 1 << 16;
+    struct trace_record *records = (struct trace_record *)malloc(capacity * sizeof(struct trace_record));
+    struct tuple mem_access;
+    *count = 0;
+    while (records != NULL && next_trace_record(src, &mem_access))
+    {
+        int page_number = get_page_number(mem_access.add);
+        if (page_number < 0 || page_number >= TABLE_ENTRIES || mem_access.instruction_type == 'X')
+        {
+            continue;
+        }
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            records = (struct trace_record *)realloc(records, capacity * sizeof(struct trace_record));
+            if (records == NULL)
+            {
+                break;
+            }
+        }
+        records[*count].instruction_type = mem_access.instruction_type;
+        records[*count].page_number = page_number;
+        (*count)++;
+    }
+    if (records == NULL)
+    {
+        perror("Failed to allocate memory for trace records");
+        exit(EXIT_FAILURE);
+    }
+    check_next_use_coverage(*count);
+    return records;
+}
+
+// Time one loop over the records on a fresh simulation, best of BENCH_REPEATS runs
+double time_kernel(void (*run)(struct vm_sim *, struct trace_record *, long long), struct vm_sim *template, struct trace_record *records, long long count, struct vm_sim *result)
+{
+    double best = -1;
+    for (int rep = 0; rep < BENCH_REPEATS; rep++)
+    {
+        struct vm_sim sim;
+        init_sim(&sim, template->algorithm, template->policy);
+        if (tracking_phases())
+        {
+            begin_phase(&sim, 'i', sim.num_of_frames);
+        }
+
+        double start = now_seconds();
+        run(&sim, records, count);
+        double elapsed = now_seconds() - start;
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+
+        result->total_accesses = sim.total_accesses;
+        result->page_faults = sim.page_faults;
+        result->writes = sim.writes;
+        free_sim(&sim);
+    }
+    return best;
+}
+
+// Compare the generic loop against each algorithm's specialised kernel over the same records
+void run_benchmark(struct trace_source *src, struct vm_sim *sims, int sim_count)
+{
+    long long count;
+    struct trace_record *records = load_trace_records(src, &count);
+
+    printf("\nBenchmark (%lld records, best of %d runs):#####################\n", count, BENCH_REPEATS);
+    printf("%-10s %18s %22s %9s\n", "Algorithm", "Generic ns/access", "Specialised ns/access", "Speedup");
+    for (int i = 0; i < sim_count; i++)
+    {
+        void (*specialised)(struct vm_sim *, struct trace_record *, long long) = specialised_loop(sims[i].policy);
+
+        struct vm_sim generic_result, specialised_result;
+        double generic_time = time_kernel(run_records_generic, &sims[i], records, count, &generic_result);
+        double specialised_time = time_kernel(specialised, &sims[i], records, count, &specialised_result);
+
+        long long accesses = generic_result.total_accesses > 0 ? generic_result.total_accesses : 1;
+        printf("%-10s %18.2f %22.2f %8.2fx\n", sims[i].algorithm,
+               generic_time * 1e9 / accesses, specialised_time * 1e9 / accesses,
+               specialised_time > 0 ? generic_time / specialised_time : 0.0);
+
+        // Both loops must simulate exactly the same thing
+        if (generic_result.page_faults != specialised_result.page_faults || generic_result.writes != specialised_result.writes)
+        {
+            fprintf(stderr, "Kernel mismatch for %s: generic %lld faults/%lld writes, specialised %lld faults/%lld writes\n",
+                    sims[i].algorithm, generic_result.page_faults, generic_result.writes,
+                    specialised_result.page_faults, specialised_result.writes);
+        }
+    }
+    free(records);
+}
+// end implementation
+
+// Sharded replacement
+// begin implementation
+// Pages are hashed into shard_count partitions, each an independent simulation with its
+// share of the frames, its own replacement state and its own counters, like a page cache
+// with per-node or per-set lists. Shards run on worker threads (shard i on worker
+// i % threads) fed by the dispatcher through a queue of batches per worker. Every shard
+// sees its accesses in trace order, so results do not depend on the number of threads.
+struct shard_access
+{
+    long long line_num;
+    int page_number;
+    int shard;
+    char instruction_type;
+};
+
+struct shard_batch
+{
+    int count;
+    struct shard_access accesses[SHARD_BATCH];
+};
+
+// Single-producer single-consumer queue of batches, as the shared-memory trace ring
+struct shard_worker
+{
+    pthread_t thread;
+    struct vm_sim *shards;
+    long long *last_line;       // Per shard: line of its previous access, for NRU refreshes
+    enum policy policy;
+    struct shard_batch *batches;  // SHARD_QUEUE_DEPTH slots
+    _Atomic unsigned long long head __attribute__((aligned(64))); // Next batch the dispatcher fills
+    _Atomic unsigned long long tail __attribute__((aligned(64))); // Next batch the worker runs
+    _Atomic int closed;
+};
+
+// Parse "<shards>[:<threads>]"; the sweep goes up to one thread per shard by default
+int parse_shards(char *spec)
+{
+    int fields = sscanf(spec, "%d:%d", &shard_count, &shard_threads);
+    if (fields < 1 || shard_count <= 0)
+    {
+        return -1;
+    }
+    if (fields == 1)
+    {
+        shard_threads = shard_count;
+    }
+    if (shard_threads <= 0 || shard_threads > shard_count)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int shard_of(int page_number)
+{
+    return (int)((sketch_hash(page_number) >> 32) % (unsigned long long)shard_count);
+}
+
+// Frames of shard `shard`: an even split, with the remainder going to the first shards
+static inline int shard_frames(int shard)
+{
+    return num_of_frames / shard_count + (shard < num_of_frames % shard_count ? 1 : 0);
+}
+
+static inline __attribute__((always_inline)) void run_shard_batch(struct shard_worker *worker, struct shard_batch *batch, enum policy policy)
+{
+    for (int i = 0; i < batch->count; i++)
+    {
+        struct shard_access *access = &batch->accesses[i];
+        struct vm_sim *sim = &worker->shards[access->shard];
+
+        // The refresh timer is global: clear the shard's bits if a refresh fell between its accesses
+        if (policy == POLICY_NRU)
+        {
+            long long last = worker->last_line[access->shard];
+            if (access->line_num % refresh_rate != 0 && access->line_num / refresh_rate != last / refresh_rate)
+            {
+                nru_refresh(sim);
+            }
+            worker->last_line[access->shard] = access->line_num;
+        }
+        access_kernel(sim, access->instruction_type, access->page_number, access->line_num, policy);
+    }
+}
+
+void *shard_worker_main(void *arg)
+{
+    struct shard_worker *worker = (struct shard_worker *)arg;
+    unsigned long long tail = 0;
+    while (1)
+    {
+        // The dispatcher and the workers may share a core, so wait by yielding it
+        if (tail == atomic_load_explicit(&worker->head, memory_order_acquire))
+        {
+            if (atomic_load_explicit(&worker->closed, memory_order_acquire) &&
+                tail == atomic_load_explicit(&worker->head, memory_order_acquire))
             {
-                // Allocate the page
-                allocate_page(instruction_type, page_number);
-                frames_allocated++;
-
-                // Add page to the clock list if the algorithm is clock
-                if (strcmp(algorithm, "clock") == 0)
-                {
-                    struct node *new_node = create_node(1, page_number);
-                    insert_node(&clock_list, new_node);
-                }
+                break;
             }
-            else /* If there is not anyframe available, then we have to evict an existing frame */
-            {
-                // printf("No frames available, evicting...\n");
-                //  Evict a frame using an algorithm opt, nru, clock.
-                int to_be_evicted = -1; /* Page number to be evicted */
-                if (algorithm == NULL)
-                {
-                    perror("No algorithm specified");
-                    return;
-                }
-                if (strcmp(algorithm, "opt") == 0)
-                {
-                    // Optimal algorithm
-                    to_be_evicted = opt(line_num);
-                    if (to_be_evicted == -1)
-                    {
-                        perror("Optimal algorithm failed to find a frame to evict");
-                        return;
-                    }
-                    // printf("opt returned page: %d\n", to_be_evicted);
-                }
-                else if (strcmp(algorithm, "nru") == 0)
-                {
-                    to_be_evicted = nru(line_num);
-                }
-                else if (strcmp(algorithm, "clock") == 0)
-                {
-                    display_list(&clock_list);
-                    to_be_evicted = clock();
-                }
-                else
-                {
-                    perror("Invalid algorithm specified");
-                    return;
-                }
+            sched_yield();
+            continue;
+        }
 
-                // Evict the frame
-                // printf("Evicting page: %d\n", to_be_evicted);
-                struct page_table_entry *evicted_entry = &page_table[to_be_evicted];
+        struct shard_batch *batch = &worker->batches[tail % SHARD_QUEUE_DEPTH];
+        switch (worker->policy)
+        {
+        case POLICY_OPT:
+            run_shard_batch(worker, batch, POLICY_OPT);
+            break;
+        case POLICY_NRU:
+            run_shard_batch(worker, batch, POLICY_NRU);
+            break;
+        case POLICY_CLOCK:
+            run_shard_batch(worker, batch, POLICY_CLOCK);
+            break;
+        }
+        tail++;
+        atomic_store_explicit(&worker->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
 
-                // Evict the frame
-                if (to_be_evicted < 0) /* If the evicted page is not a positive int, then we're doing smth wrong */
-                {
-                    perror("Invalid page number to be evicted.\nTerminating");
-                    printf("to_be_evicted: %d\n", to_be_evicted);
-                    return;
-                }
+// Wait for a free slot in the worker's queue and return it, emptied
+struct shard_batch *claim_batch(struct shard_worker *worker)
+{
+    unsigned long long head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&worker->tail, memory_order_acquire) >= SHARD_QUEUE_DEPTH)
+    {
+        sched_yield();
+    }
+    struct shard_batch *batch = &worker->batches[head % SHARD_QUEUE_DEPTH];
+    batch->count = 0;
+    return batch;
+}
 
-                if (strcmp(algorithm, "opt") == 0) /* if a page is evicted remove it from the opt list */
-                {
-                    remove_page(&opt_list, to_be_evicted);
-                }
+void publish_batch(struct shard_worker *worker)
+{
+    unsigned long long head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+    atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+}
 
-                int is_dirty = evicted_entry->dirty;
+// Simulate the records on fresh shards with `threads` workers and return the wall-clock time
+double run_shards(struct vm_sim *template, struct trace_record *records, long long count, int threads, struct vm_sim *shards)
+{
+    long long *last_line = (long long *)calloc(shard_count, sizeof(long long));
+    struct shard_batch **filling = (struct shard_batch **)calloc(threads, sizeof(struct shard_batch *));
 
-                // If to_be_evicted is dirty, write to disk
-                if (is_dirty)
-                {
-                    writes++;
-                }
+    // Each worker's head and tail need their own cache lines, which calloc does not align to
+    struct shard_worker *workers = NULL;
+    if (posix_memalign((void **)&workers, _Alignof(struct shard_worker), threads * sizeof(struct shard_worker)) != 0)
+    {
+        workers = NULL;
+    }
+    if (!last_line || !workers || !filling)
+    {
+        perror("Failed to allocate memory for shards");
+        exit(EXIT_FAILURE);
+    }
+    memset(workers, 0, threads * sizeof(struct shard_worker));
 
-                // Clean up the evicted frame
-                evicted_entry->valid = 0;
-                evicted_entry->ref = 0;
-                evicted_entry->dirty = 0;
+    for (int i = 0; i < shard_count; i++)
+    {
+        init_sim(&shards[i], template->algorithm, template->policy);
+        shards[i].num_of_frames = shard_frames(i);
+    }
 
-                // get page number and offset of the evicted frame
-                int evicted_page_number = to_be_evicted;
-                int evicted_offset = 0;
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].shards = shards;
+        workers[i].last_line = last_line;
+        workers[i].policy = template->policy;
+        workers[i].batches = (struct shard_batch *)malloc(SHARD_QUEUE_DEPTH * sizeof(struct shard_batch));
+        if (!workers[i].batches)
+        {
+            perror("Failed to allocate memory for shard batches");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&workers[i].thread, NULL, shard_worker_main, &workers[i]) != 0)
+        {
+            perror("Failed to start a shard worker");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-                // Allocate the new page
-                allocate_page(instruction_type, evicted_page_number);
+    // Dispatch: route every record to the worker owning its shard
+    for (long long line_num = 0; line_num < count; line_num++)
+    {
+        int shard = shard_of(records[line_num].page_number);
+        int thread = shard % threads;
+        struct shard_worker *worker = &workers[thread];
+        if (filling[thread] == NULL)
+        {
+            filling[thread] = claim_batch(worker);
+        }
 
-                // Add the new page to the clock list
-                if (strcmp(algorithm, "clock") == 0)
-                {
-                    struct node *new_node = create_node(1, page_number);
-                    insert_node(&clock_list, new_node);
-                }
-            }
+        struct shard_access *access = &filling[thread]->accesses[filling[thread]->count++];
+        access->line_num = line_num;
+        access->page_number = records[line_num].page_number;
+        access->shard = shard;
+        access->instruction_type = records[line_num].instruction_type;
+        if (filling[thread]->count == SHARD_BATCH)
+        {
+            publish_batch(worker);
+            filling[thread] = NULL;
         }
-        else
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (filling[i] != NULL)
         {
-            // PAGE HIT!
-            // Set the ref bit to 1 (unneccessary, but doesn't hurt)
-            entry->ref = 1;
+            publish_batch(&workers[i]);
         }
+        atomic_store_explicit(&workers[i].closed, 1, memory_order_release);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].batches);
+    }
+    double elapsed = now_seconds() - start;
+
+    free(filling);
+    free(workers);
+    free(last_line);
+    return elapsed;
+}
 
-        // increment the line number
-        line_num++;
+void sum_shards(struct vm_sim *shards, struct vm_sim *total)
+{
+    memset(total, 0, sizeof(struct vm_sim));
+    for (int i = 0; i < shard_count; i++)
+    {
+        total->total_accesses += shards[i].total_accesses;
+        total->page_faults += shards[i].page_faults;
+        total->writes += shards[i].writes;
     }
 }
 
-void print_stats(char *algorithm)
+// For every algorithm: the fault cost of sharding against the unified pool, the
+// per-shard counters, and wall-clock throughput as worker threads are added
+void run_sharded(struct trace_source *src, struct vm_sim *sims, int sim_count)
 {
-    printf("\n\n\nStats:#######################################################\n");
-    printf("Algorithm: %s\n", algorithm);
-    printf("Number of Frame: %d\n", num_of_frames);
-    printf("Total Accesses: %d\n", total_accesses);
-    printf("Page Faults: %d\n", page_faults);
-    printf("Writes: %d\n", writes);
+    long long count;
+    struct trace_record *records = load_trace_records(src, &count);
+    struct vm_sim *shards = (struct vm_sim *)calloc(shard_count, sizeof(struct vm_sim));
+    if (!shards)
+    {
+        perror("Failed to allocate memory for shards");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < sim_count; i++)
+    {
+        void (*specialised)(struct vm_sim *, struct trace_record *, long long) = specialised_loop(sims[i].policy);
+
+        // The unified pool, on the calling thread
+        struct vm_sim unified;
+        init_sim(&unified, sims[i].algorithm, sims[i].policy);
+        double start = now_seconds();
+        specialised(&unified, records, count);
+        double unified_time = now_seconds() - start;
+
+        printf("\nSharded %s (%d shards, %d frames, %lld records):##############\n",
+               sims[i].algorithm, shard_count, num_of_frames, count);
+        printf("%-8s %10s %10s %8s %9s\n", "Pool", "Faults", "Writes", "Fault%", "Excess");
+
+        // The first sweep point's shards are kept for the per-shard table
+        struct vm_sim sharded;
+        double one_thread_time = run_shards(&sims[i], records, count, 1, shards);
+        sum_shards(shards, &sharded);
+
+        long long accesses = unified.total_accesses > 0 ? unified.total_accesses : 1;
+        long long unified_faults = unified.page_faults > 0 ? unified.page_faults : 1;
+        printf("%-8s %10lld %10lld %7.2f%% %9s\n", "unified", unified.page_faults, unified.writes,
+               100.0 * unified.page_faults / accesses, "-");
+        printf("%-8s %10lld %10lld %7.2f%% %+8.2f%%\n", "sharded", sharded.page_faults, sharded.writes,
+               100.0 * sharded.page_faults / accesses, 100.0 * (sharded.page_faults - unified.page_faults) / unified_faults);
+
+        printf("%-6s %7s %10s %10s %10s %8s\n", "Shard", "Frames", "Accesses", "Faults", "Writes", "Fault%");
+        for (int j = 0; j < shard_count; j++)
+        {
+            printf("%-6d %7d %10lld %10lld %10lld %7.2f%%\n", j, shards[j].num_of_frames,
+                   shards[j].total_accesses, shards[j].page_faults, shards[j].writes,
+                   shards[j].total_accesses ? 100.0 * shards[j].page_faults / shards[j].total_accesses : 0.0);
+        }
+        for (int j = 0; j < shard_count; j++)
+        {
+            free_sim(&shards[j]);
+        }
+
+        printf("%-8s %9s %15s %8s\n", "Threads", "Seconds", "Records/s", "Speedup");
+        printf("%-8s %9.3f %15.0f %8s\n", "unified", unified_time, unified_time > 0 ? count / unified_time : 0.0, "-");
+        for (int threads = 1; threads <= shard_threads; threads = threads < shard_threads && 2 * threads > shard_threads ? shard_threads : 2 * threads)
+        {
+            double elapsed = one_thread_time;
+            if (threads > 1)
+            {
+                struct vm_sim result;
+                elapsed = run_shards(&sims[i], records, count, threads, shards);
+                sum_shards(shards, &result);
+                for (int j = 0; j < shard_count; j++)
+                {
+                    free_sim(&shards[j]);
+                }
+
+                // Shards see the same accesses in the same order whatever the thread count
+                if (result.page_faults != sharded.page_faults || result.writes != sharded.writes)
+                {
+                    fprintf(stderr, "Shard mismatch for %s with %d threads: %lld faults/%lld writes, expected %lld faults/%lld writes\n",
+                            sims[i].algorithm, threads, result.page_faults, result.writes, sharded.page_faults, sharded.writes);
+                }
+            }
+            printf("%-8d %9.3f %15.0f %7.2fx\n", threads, elapsed, elapsed > 0 ? count / elapsed : 0.0,
+                   elapsed > 0 ? one_thread_time / elapsed : 0.0);
+        }
+        free_sim(&unified);
+    }
+    free(shards);
+    free(records);
 }
+// end implementation
 
-void print_usage()
+void print_stats(struct vm_sim *sim)
 {
-    printf("Usage: vmsim -n <numframes> -a <opt|clock|nru> [-r <refresh>] <tracefile>\n");
+    printf("\n\n\nStats:#######################################################\n");
+    printf("Algorithm: %s\n", sim->algorithm);
+    printf("Number of Frame: %d\n", sim->num_of_frames);
+    printf("Total Accesses: %lld\n", sim->total_accesses);
+    printf("Page Faults: %lld\n", sim->page_faults);
+    printf("Writes: %lld\n", sim->writes);
 }
 
-void init_page_table()
+void print_phase_stats(struct vm_sim *sim)
 {
-    for (int i = 0; i < TABLE_ENTRIES; i++)
+    printf("\nPhases (%s):################################################\n", sim->algorithm);
+    printf("%-5s %-6s %10s %7s %10s %9s %8s %8s %8s %9s %10s\n",
+           "Phase", "Source", "Start", "Frames", "Accesses", "Faults", "Fault%", "Writes", "Evicted", "Baseline%", "Recovery");
+    for (int i = 0; i < sim->phase_count; i++)
     {
-        page_table[i].valid = 0;
-        page_table[i].ref = 0;
-        page_table[i].dirty = 0;
+        struct phase_stats *phase = &sim->phases[i];
+        long long accesses = phase->end_access - phase->start_access;
+        long long faults = phase->end_faults - phase->start_faults;
+        const char *source = phase->source == 's' ? "sched" : phase->source == 'p' ? "pff" : "init";
+
+        char baseline[16];
+        char recovery[24];
+        if (phase->frames >= phase->prev_frames) /* Only shrinks have something to recover from */
+        {
+            snprintf(baseline, sizeof(baseline), "-");
+            snprintf(recovery, sizeof(recovery), "-");
+        }
+        else
+        {
+            snprintf(baseline, sizeof(baseline), "%.2f%%", 100.0 * phase->baseline_rate);
+            if (phase->recovered_after < 0)
+            {
+                snprintf(recovery, sizeof(recovery), "never");
+            }
+            else
+            {
+                snprintf(recovery, sizeof(recovery), "%lld", phase->recovered_after);
+            }
+        }
+
+        printf("%-5d %-6s %10lld %7d %10lld %9lld %7.2f%% %8lld %8d %9s %10s\n",
+               i, source, phase->start_access, phase->frames, accesses, faults,
+               accesses ? 100.0 * faults / accesses : 0.0,
+               phase->end_writes - phase->start_writes, phase->bulk_evictions,
+               baseline, recovery);
     }
+    printf("Recovery: accesses after a shrink until a %d-access window's fault rate fell back to the baseline.\n", window_size);
+}
+
+void print_usage()
+{
+    printf("Usage: vmsim -n <numframes> -a <opt|clock|nru>[,<algorithm>...] [-r <refresh>] [-s <schedule>] [-p <window>:<low>:<high>[:<min>:<max>]] [-i <interval>] [-H <top k>] [-O <windows>]\n"
+           "             [-t <slow frames>[:<algorithm>] [-l <fast ns>:<slow ns>:<fault ns>] [-P first|count:<N>|scan:<N>]] [-B] [-S <shards>[:<threads>]] <tracefile|-|shm:name>\n");
+    printf("       vmsim -R <shm name>   (relay Lackey output from stdin into a shared-memory ring)\n");
+}
+
+void handle_sigint(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
 }
 
 int main(int argc, char *argv[])
@@ -788,10 +3334,15 @@ int main(int argc, char *argv[])
     extern int optind;
     int n_flag = 0, a_flag = 0, r_flag = 0;
     char *tracefile = NULL;
-    clock_list.head = NULL;
-    opt_list = NULL;
+    char *relay_name = NULL;
 
-    while ((opt = getopt(argc, argv, "n:a:r:")) != -1)
+    // Stop reading on Ctrl-C but still print the stats gathered so far
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+
+    while ((opt = getopt(argc, argv, "n:a:r:s:p:i:H:O:t:l:P:BS:R:")) != -1)
     {
         switch (opt)
         {
@@ -817,12 +3368,88 @@ int main(int argc, char *argv[])
             }
             r_flag = 1;
             break;
+        case 's':
+            if (load_schedule(optarg) != 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            if (parse_pff(optarg) != 0)
+            {
+                fprintf(stderr, "Invalid fault rate control: expected <window>:<low>:<high>[:<min>:<max>] with low <= high.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            stats_interval = atoll(optarg);
+            if (stats_interval <= 0)
+            {
+                fprintf(stderr, "Invalid stats interval: Must be greater than zero.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            profile_top_k = atoi(optarg);
+            if (profile_top_k <= 0)
+            {
+                fprintf(stderr, "Invalid top-K size: Must be greater than zero.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'O':
+            regret_windows = atoi(optarg);
+            if (regret_windows <= 0)
+            {
+                fprintf(stderr, "Invalid number of regret windows: Must be greater than zero.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (parse_slow_tier(optarg) != 0)
+            {
+                fprintf(stderr, "Invalid slow tier: expected <frames>[:<algorithm>] with frames greater than zero.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            if (parse_latencies(optarg) != 0)
+            {
+                fprintf(stderr, "Invalid latencies: expected <fast ns>:<slow ns>:<fault ns>.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            if (parse_promotion(optarg) != 0)
+            {
+                fprintf(stderr, "Invalid promotion policy: expected first, count:<N> or scan:<N> with N greater than zero.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            benchmark = 1;
+            break;
+        case 'S':
+            if (parse_shards(optarg) != 0)
+            {
+                fprintf(stderr, "Invalid sharding: expected <shards>[:<threads>] with 1 <= threads <= shards.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            relay_name = optarg;
+            break;
         case '?':
             print_usage();
             return EXIT_FAILURE;
         }
     }
 
+    if (relay_name != NULL)
+    {
+        return run_relay(relay_name);
+    }
+
     if (optind >= argc)
     {
         fprintf(stderr, "Missing trace file.\n");
@@ -832,32 +3459,224 @@ int main(int argc, char *argv[])
 
     tracefile = argv[optind];
 
-    if (!n_flag || !a_flag || strcmp(algorithm, "nru") == 0 && !r_flag)
+    if (!n_flag || !a_flag)
     {
         fprintf(stderr, "Missing required arguments.\n");
         print_usage();
         return EXIT_FAILURE;
     }
 
-    FILE *f = fopen(tracefile, "r");
+    if (slow_frames > 0 && (tracking_phases() || profile_top_k > 0 || benchmark || regret_windows > 0))
+    {
+        fprintf(stderr, "Tiered mode (-t) cannot be combined with -s, -p, -H, -O or -B.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (regret_windows > 0 && benchmark)
+    {
+        fprintf(stderr, "Regret analysis (-O) cannot be combined with -B.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (shard_count > 0 && (tracking_phases() || profile_top_k > 0 || regret_windows > 0 || slow_frames > 0 || benchmark || stats_interval > 0))
+    {
+        fprintf(stderr, "Sharded mode (-S) cannot be combined with -s, -p, -i, -H, -O, -t or -B.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (shard_count > num_of_frames)
+    {
+        fprintf(stderr, "Invalid sharding: every shard needs at least one frame.\n");
+        return EXIT_FAILURE;
+    }
+
+    enum policy slow_policy;
+    if (slow_algorithm != NULL && parse_policy(slow_algorithm, &slow_policy) != 0)
+    {
+        fprintf(stderr, "Invalid algorithm: %s\n", slow_algorithm);
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    // One simulation per requested algorithm, or one pair of tiers in tiered mode
+    struct vm_sim *sims = NULL;
+    int sim_count = 0;
+    struct tiered_sim *tiers = NULL;
+    int tier_count = 0;
+    int needs_opt = 0;
+    for (char *name = strtok(algorithm, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        enum policy policy;
+        if (parse_policy(name, &policy) != 0)
+        {
+            fprintf(stderr, "Invalid algorithm: %s\n", name);
+            print_usage();
+            return EXIT_FAILURE;
+        }
+
+        if (slow_frames > 0)
+        {
+            char *slow_name = slow_algorithm != NULL ? slow_algorithm : name;
+            if (slow_algorithm == NULL)
+            {
+                slow_policy = policy;
+            }
+            if ((policy == POLICY_NRU || slow_policy == POLICY_NRU) && !r_flag)
+            {
+                fprintf(stderr, "Missing required arguments.\n");
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            needs_opt |= policy == POLICY_OPT || slow_policy == POLICY_OPT;
+
+            tiers = (struct tiered_sim *)realloc(tiers, (tier_count + 1) * sizeof(struct tiered_sim));
+            if (!tiers)
+            {
+                perror("Failed to allocate memory for simulations");
+                return EXIT_FAILURE;
+            }
+            init_tiered_sim(&tiers[tier_count++], name, policy, slow_name, slow_policy);
+            continue;
+        }
+
+        if (policy == POLICY_NRU && !r_flag)
+        {
+            fprintf(stderr, "Missing required arguments.\n");
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        needs_opt |= policy == POLICY_OPT;
+
+        sims = (struct vm_sim *)realloc(sims, (sim_count + 1) * sizeof(struct vm_sim));
+        if (!sims)
+        {
+            perror("Failed to allocate memory for simulations");
+            return EXIT_FAILURE;
+        }
+        init_sim(&sims[sim_count++], name, policy);
+    }
+
+    // Regret is measured against an opt simulation over the same trace, added if not requested
+    int opt_index = -1;
+    for (int i = 0; i < sim_count; i++)
+    {
+        if (sims[i].policy == POLICY_OPT && opt_index < 0)
+        {
+            opt_index = i;
+        }
+    }
+    if (regret_windows > 0)
+    {
+        if (opt_index >= 0 && sim_count == 1)
+        {
+            fprintf(stderr, "Regret analysis (-O) needs an algorithm other than opt.\n");
+            return EXIT_FAILURE;
+        }
+        if (opt_index < 0)
+        {
+            sims = (struct vm_sim *)realloc(sims, (sim_count + 1) * sizeof(struct vm_sim));
+            if (!sims)
+            {
+                perror("Failed to allocate memory for simulations");
+                return EXIT_FAILURE;
+            }
+            opt_index = sim_count;
+            init_sim(&sims[sim_count++], "opt", POLICY_OPT);
+        }
+        needs_opt = 1;
+    }
 
-    if (f == NULL)
+    struct trace_source src;
+    if (open_trace_source(&src, tracefile) != 0)
     {
         perror("Failed to open trace file");
         return EXIT_FAILURE;
     }
-    if (strcmp(algorithm, "opt") == 0)
+
+    if (needs_opt)
+    {
+        // opt reads the whole trace ahead of time, which a live stream cannot offer
+        if (!src.seekable)
+        {
+            fprintf(stderr, "The opt algorithm needs a trace file, it cannot run on a live stream.\n");
+            close_trace_source(&src);
+            return EXIT_FAILURE;
+        }
+        load_next_use_index(&next_use_index, src.file == stdin ? NULL : tracefile, src.file);
+    }
+
+    for (int i = 0; i < sim_count && regret_windows > 0; i++)
+    {
+        if (sims[i].policy != POLICY_OPT)
+        {
+            sims[i].regret = create_regret(&sims[opt_index], next_use_index.records);
+        }
+    }
+
+    // Collapsing is exact for flat simulations; phases and tiers act between individual records
+    src.collapse = tier_count == 0 && !tracking_phases();
+
+    if (benchmark || shard_count > 0)
+    {
+        if (benchmark)
+        {
+            run_benchmark(&src, sims, sim_count);
+        }
+        else
+        {
+            run_sharded(&src, sims, sim_count);
+        }
+        close_trace_source(&src);
+        free_next_use_index(&next_use_index);
+        for (int i = 0; i < sim_count; i++)
+        {
+            free_sim(&sims[i]);
+        }
+        free(sims);
+        return 0;
+    }
+
+    process_trace_file(&src, sims, sim_count, tiers, tier_count);
+    for (int i = 0; i < tier_count; i++)
+    {
+        print_tiered_stats(&tiers[i]);
+    }
+    if (src.collapse)
+    {
+        printf("\nTrace Records: %lld collapsed into %lld same-page runs (%.2f records per run)\n",
+               trace_records, trace_runs, trace_runs ? (double)trace_records / trace_runs : 0.0);
+    }
+    for (int i = 0; i < sim_count; i++)
     {
-        init_opt_list(&opt_list, f);
+        print_stats(&sims[i]);
+        if (tracking_phases())
+        {
+            print_phase_stats(&sims[i]);
+        }
+        if (sims[i].profile != NULL)
+        {
+            print_profile(sims[i].profile, sims[i].page_table, sims[i].algorithm);
+        }
+        if (sims[i].regret != NULL)
+        {
+            print_regret(&sims[i]);
+        }
     }
+    close_trace_source(&src);
 
-    init_page_table();
-    process_trace_file(f);
-    print_stats(algorithm);
-    fclose(f);
-    free_all(opt_list);
-    // free_all(&clock_list);
     //  Free all necessary memory
+    free_next_use_index(&next_use_index);
+    for (int i = 0; i < sim_count; i++)
+    {
+        free_sim(&sims[i]);
+    }
+    free(sims);
+    for (int i = 0; i < tier_count; i++)
+    {
+        free_tiered_sim(&tiers[i]);
+    }
+    free(tiers);
+    free(schedule);
 
     return 0;
-}
\ No newline at end of file
+}